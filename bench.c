@@ -0,0 +1,508 @@
+#include <locale.h>
+
+#define PG_CONVERTER_IMPLEMENTATION
+#include "pigaco/converter.h"
+
+#include "bench_images.h"
+
+#define BENCH_MAX_REPS 101
+/* Powers of two below max_threads, then max_threads itself. */
+#define BENCH_THREAD_COUNTS 32
+
+typedef struct {
+  int max_size;
+  int reps;
+  int max_threads;
+  const char *image;
+} BenchConfig;
+
+static int compare_ns(const void *a, const void *b) {
+  unsigned long long x = *(const unsigned long long *)a;
+  unsigned long long y = *(const unsigned long long *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Median and p99 of samples, with throughput at the median. cells is 0 for
+ * stages that run before the cell grid exists. */
+static void report(const char *stage, const char *image, int size,
+                   int threads, unsigned long long *samples, int count,
+                   double pixels, double cells) {
+  qsort(samples, count, sizeof(*samples), compare_ns);
+
+  unsigned long long median = samples[count / 2];
+  int p99_index = (int)((count * 99 + 99) / 100) - 1;
+  unsigned long long p99 = samples[p99_index < 0 ? 0 : p99_index];
+  double seconds = median > 0 ? median / 1e9 : 1e-9;
+
+  wprintf(L"%-24s %-9s %6d %3d %10.3f %10.3f %10.1f", stage, image, size,
+          threads, median / 1e6, p99 / 1e6, pixels / seconds / 1e6);
+  if (cells > 0)
+    wprintf(L" %10.2f\n", cells / seconds / 1e6);
+  else
+    wprintf(L" %10s\n", "-");
+}
+
+static int bench_decode(const BenchConfig *config, const char *image,
+                        const pgu8 *rgb, int size) {
+  const char *names[] = {"decode/ppm", "decode/bmp"};
+  unsigned long long samples[BENCH_MAX_REPS];
+
+  for (int format = 0; format < 2; format++) {
+    int length;
+    pgu8 *encoded = format == 0 ? encode_ppm(rgb, size, size, &length)
+                                : encode_bmp(rgb, size, size, &length);
+    if (!encoded)
+      return -1;
+
+    for (int rep = 0; rep < config->reps; rep++) {
+      int width, height, channels;
+      unsigned long long start = pg__now_ns();
+      pgu8 *decoded = stbi_load_from_memory(encoded, length, &width, &height,
+                                            &channels, 3);
+      samples[rep] = pg__now_ns() - start;
+
+      if (!decoded) {
+        fwprintf(stderr, L"Failed to decode %s: %s\n", names[format],
+                 stbi_failure_reason());
+        PG_FREE(encoded);
+        return -1;
+      }
+      if (rep == 0 &&
+          memcmp(decoded, rgb, (size_t)size * size * 3) != 0) {
+        fwprintf(stderr, L"%s round trip mismatch\n", names[format]);
+        stbi_image_free(decoded);
+        PG_FREE(encoded);
+        return -1;
+      }
+      stbi_image_free(decoded);
+    }
+    PG_FREE(encoded);
+
+    report(names[format], image, size, 1, samples, config->reps,
+           (double)size * size, 0);
+  }
+
+  return 0;
+}
+
+/* Single-threaded kernels: the SIMD luma path checked against the scalar
+ * one, the ordered dither rows likewise, and the legacy serial
+ * apply__contrast and floyd__steinberg_dither. */
+static int bench_kernels(const BenchConfig *config, const char *image,
+                         const pgu8 *rgb, int size) {
+  size_t pixels = (size_t)size * size;
+  pgu8 *gray = (pgu8 *)PG_MALLOC(pixels);
+  pgu8 *expected = (pgu8 *)PG_MALLOC(pixels);
+  pgu8 *work = (pgu8 *)PG_MALLOC(pixels);
+  unsigned long long samples[BENCH_MAX_REPS];
+  int result = -1;
+
+  if (!gray || !expected || !work)
+    goto done;
+
+  pthread_once(&pg__tables_once, pg__init_tables);
+
+  for (int rep = 0; rep < config->reps; rep++) {
+    unsigned long long start = pg__now_ns();
+    pg__gray_rgb_scalar(rgb, expected, (int)pixels);
+    samples[rep] = pg__now_ns() - start;
+  }
+  report("gray/scalar", image, size, 1, samples, config->reps, pixels, 0);
+
+  if (pg__gray_rgb != pg__gray_rgb_scalar) {
+    for (int rep = 0; rep < config->reps; rep++) {
+      unsigned long long start = pg__now_ns();
+      pg__gray_rgb(rgb, gray, (int)pixels);
+      samples[rep] = pg__now_ns() - start;
+    }
+    if (memcmp(gray, expected, pixels) != 0) {
+      fwprintf(stderr, L"SIMD gray kernel differs from scalar\n");
+      goto done;
+    }
+    report("gray/simd", image, size, 1, samples, config->reps, pixels, 0);
+  }
+
+  int ordered_simd = pg__ordered_simd;
+  for (int dither = PG_DITHER_BAYER4; dither <= PG_DITHER_BLUE_NOISE;
+       dither++) {
+    OrderedMap map;
+    pg__ordered_map(dither, &map);
+
+    for (int simd = 0; simd <= ordered_simd; simd++) {
+      char name[32];
+      snprintf(name, sizeof(name), "ordered%d/%s", dither,
+               simd ? "simd" : "scalar");
+      pg__ordered_simd = simd;
+
+      for (int rep = 0; rep < config->reps; rep++) {
+        memcpy(work, expected, pixels);
+        unsigned long long start = pg__now_ns();
+        for (int y = 0; y < size; y++)
+          pg__ordered_row(work + (size_t)y * size, size, y, &map);
+        samples[rep] = pg__now_ns() - start;
+      }
+      if (!simd)
+        memcpy(gray, work, pixels);
+      else if (memcmp(gray, work, pixels) != 0) {
+        pg__ordered_simd = ordered_simd;
+        fwprintf(stderr, L"SIMD ordered dither differs from scalar\n");
+        goto done;
+      }
+      report(name, image, size, 1, samples, config->reps, pixels, 0);
+    }
+  }
+  pg__ordered_simd = ordered_simd;
+
+  for (int rep = 0; rep < config->reps; rep++) {
+    memcpy(work, expected, pixels);
+    unsigned long long start = pg__now_ns();
+    apply__contrast(work, size, size, 1.5f);
+    samples[rep] = pg__now_ns() - start;
+  }
+  report("apply__contrast", image, size, 1, samples, config->reps, pixels, 0);
+
+  for (int rep = 0; rep < config->reps; rep++) {
+    memcpy(work, expected, pixels);
+    unsigned long long start = pg__now_ns();
+    floyd__steinberg_dither(work, size, size);
+    samples[rep] = pg__now_ns() - start;
+  }
+  report("floyd__steinberg_dither", image, size, 1, samples, config->reps,
+         pixels, 0);
+
+  result = 0;
+
+done:
+  PG_FREE(gray);
+  PG_FREE(expected);
+  PG_FREE(work);
+
+  return result;
+}
+
+/* Full conversions with stats on, one row per stage, at the given worker
+ * cap. */
+static int bench_pipeline(const BenchConfig *config, const char *image,
+                          const pgu8 *rgb, int size, int threads) {
+  static const char *stages[] = {"tone", "gray", "sample", "dither",
+                                 "render", "convert"};
+  enum { STAGES = sizeof(stages) / sizeof(stages[0]) };
+  static unsigned long long samples[STAGES][BENCH_MAX_REPS];
+  pg_converter *conv = pg_converter_create(NULL);
+  pg_options opts = pg_default_options();
+  size_t cells = 0;
+
+  if (!conv)
+    return -1;
+
+  opts.threads = threads;
+  pg_converter_set_stats(conv, 1);
+
+  for (int rep = 0; rep < config->reps; rep++) {
+    unsigned long long start = pg__now_ns();
+    if (pg_convert_pixels(conv, rgb, size, size, 3, 0, &opts) != 0) {
+      pg_converter_destroy(conv);
+      return -1;
+    }
+    unsigned long long total = pg__now_ns() - start;
+    const pg_stats *stats = pg_converter_stats(conv);
+
+    samples[0][rep] = stats->tone_ns;
+    samples[1][rep] = stats->gray_ns;
+    samples[2][rep] = stats->sample_ns;
+    samples[3][rep] = stats->dither_ns;
+    samples[4][rep] = stats->render_ns;
+    samples[5][rep] = total;
+    cells = stats->cells;
+  }
+
+  for (int i = 0; i < STAGES; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "stage/%s", stages[i]);
+    report(name, image, size, threads, samples[i], config->reps,
+           (double)size * size, (double)cells);
+  }
+
+  /* Every dither algorithm, analysis only. */
+  opts.format = PG_FORMAT_NONE;
+  for (int dither = PG_DITHER_NONE; dither <= PG_DITHER_BLUE_NOISE;
+       dither++) {
+    char name[32];
+    snprintf(name, sizeof(name), "dither%d/convert", dither);
+    opts.dither = dither;
+
+    for (int rep = 0; rep < config->reps; rep++) {
+      unsigned long long start = pg__now_ns();
+      if (pg_convert_pixels(conv, rgb, size, size, 3, 0, &opts) != 0) {
+        pg_converter_destroy(conv);
+        return -1;
+      }
+      samples[0][rep] = pg__now_ns() - start;
+    }
+    report(name, image, size, threads, samples[0], config->reps,
+           (double)size * size, (double)cells);
+  }
+
+  /* Every encoder over the grid left by the last conversion. */
+  static const struct {
+    const char *name;
+    int format;
+    int use_color;
+  } encoders[] = {
+      {"encode/ansi-mono", PG_FORMAT_ANSI, PG_COLOR_NONE},
+      {"encode/ansi-truecolor", PG_FORMAT_ANSI, PG_COLOR_TRUECOLOR},
+      {"encode/ansi-256", PG_FORMAT_ANSI, PG_COLOR_256},
+      {"encode/ansi-16", PG_FORMAT_ANSI, PG_COLOR_16},
+      {"encode/html", PG_FORMAT_HTML, PG_COLOR_TRUECOLOR},
+  };
+  const pg_grid *grid = pg_converter_grid(conv);
+  pg_encoder *enc = pg_encoder_create(NULL);
+
+  if (!enc) {
+    pg_converter_destroy(conv);
+    return -1;
+  }
+
+  for (size_t i = 0; i < sizeof(encoders) / sizeof(encoders[0]); i++) {
+    opts.format = encoders[i].format;
+    opts.use_color = encoders[i].use_color;
+
+    for (int rep = 0; rep < config->reps; rep++) {
+      unsigned long long start = pg__now_ns();
+      if (pg_encode(enc, grid, &opts) != 0) {
+        pg_encoder_destroy(enc);
+        pg_converter_destroy(conv);
+        return -1;
+      }
+      samples[0][rep] = pg__now_ns() - start;
+    }
+    report(encoders[i].name, image, size, threads, samples[0], config->reps,
+           (double)size * size, (double)cells);
+  }
+
+  pg_encoder_destroy(enc);
+  pg_converter_destroy(conv);
+
+  return 0;
+}
+
+/* The output path before frames were rendered straight to UTF-8, kept as a
+ * baseline: each cell swprintf'd into a wchar_t line, which then goes
+ * through the locale's wide to multibyte conversion as wprintf did. Returns
+ * the length written to out, or 0 on failure. */
+static size_t encode_wide(const pg_grid *grid, wchar_t *line,
+                          size_t line_size, char *out) {
+  size_t length = 0;
+
+  for (int y = 0; y < grid->rows; y++) {
+    const pgu8 *glyphs = grid->glyphs + (size_t)y * grid->cols;
+    const pgu8 *fg = grid->fg + (size_t)y * grid->cols * 3;
+    size_t pos = 0;
+
+    for (int x = 0; x < grid->cols; x++) {
+      int n = swprintf(line + pos, line_size - pos,
+                       L"\033[38;2;%d;%d;%dm%lc\033[0m", fg[x * 3],
+                       fg[x * 3 + 1], fg[x * 3 + 2],
+                       (wint_t)ASCII_CHARS[glyphs[x]]);
+      if (n < 0)
+        return 0;
+      pos += n;
+    }
+
+    size_t n = wcstombs(out + length, line, line_size * MB_CUR_MAX);
+    if (n == (size_t)-1)
+      return 0;
+    length += n;
+    out[length++] = '\n';
+  }
+
+  return length;
+}
+
+/* The UTF-8 byte encoder against the wide path it replaced, one thread each,
+ * on a 3840x2160 frame at a coarse and a fine scale. Both must produce the
+ * same bytes. */
+static int bench_output(const BenchConfig *config) {
+  enum { WIDTH = 3840, HEIGHT = 2160 };
+  static const int scales[] = {8, 2};
+  unsigned long long samples[BENCH_MAX_REPS];
+  pgu8 *rgb = (pgu8 *)PG_MALLOC((size_t)WIDTH * HEIGHT * 3);
+  pg_converter *conv = pg_converter_create(NULL);
+  pg_encoder *enc = pg_encoder_create(NULL);
+  int reps = config->reps ? config->reps : 5;
+  int result = -1;
+
+  if (!rgb || !conv || !enc)
+    goto done;
+
+  fill_photo(rgb, WIDTH, HEIGHT);
+
+  for (size_t i = 0; i < sizeof(scales) / sizeof(scales[0]); i++) {
+    pg_options opts = pg_default_options();
+    opts.scale = scales[i];
+    opts.use_color = PG_COLOR_TRUECOLOR;
+    opts.merge_colors = 0;
+    opts.threads = 1;
+    opts.format = PG_FORMAT_NONE;
+
+    if (pg_convert_pixels(conv, rgb, WIDTH, HEIGHT, 3, 0, &opts) != 0)
+      goto done;
+
+    const pg_grid *grid = pg_converter_grid(conv);
+    double cells = (double)grid->cols * grid->rows;
+    size_t line_size = (size_t)grid->cols * 24 + 1;
+    wchar_t *line = (wchar_t *)PG_MALLOC(line_size * sizeof(wchar_t));
+    char *wide =
+        (char *)PG_MALLOC((line_size * MB_CUR_MAX + 1) * grid->rows);
+    size_t wide_length = 0;
+    char name[32];
+
+    if (!line || !wide) {
+      PG_FREE(line);
+      PG_FREE(wide);
+      goto done;
+    }
+
+    for (int rep = 0; rep < reps; rep++) {
+      unsigned long long start = pg__now_ns();
+      wide_length = encode_wide(grid, line, line_size, wide);
+      samples[rep] = pg__now_ns() - start;
+    }
+    snprintf(name, sizeof(name), "output/wide-s%d", scales[i]);
+    report(name, "photo-4k", WIDTH, 1, samples, reps, (double)WIDTH * HEIGHT,
+           cells);
+
+    opts.format = PG_FORMAT_ANSI;
+    for (int rep = 0; rep < reps; rep++) {
+      unsigned long long start = pg__now_ns();
+      if (pg_encode(enc, grid, &opts) != 0)
+        wide_length = 0;
+      samples[rep] = pg__now_ns() - start;
+    }
+    snprintf(name, sizeof(name), "output/utf8-s%d", scales[i]);
+    report(name, "photo-4k", WIDTH, 1, samples, reps, (double)WIDTH * HEIGHT,
+           cells);
+
+    const pg_frame *frame = pg_encoder_frame(enc);
+    int same = wide_length > 0 && frame->size == wide_length &&
+               memcmp(frame->data, wide, wide_length) == 0;
+
+    PG_FREE(line);
+    PG_FREE(wide);
+    if (!same) {
+      fwprintf(stderr, L"UTF-8 output differs from the wide path\n");
+      goto done;
+    }
+  }
+
+  result = 0;
+
+done:
+  pg_encoder_destroy(enc);
+  pg_converter_destroy(conv);
+  PG_FREE(rgb);
+
+  return result;
+}
+
+static int bench_image(const BenchConfig *config, const BenchImage *image,
+                       int size, const int *threads, int thread_counts) {
+  pgu8 *rgb = (pgu8 *)PG_MALLOC((size_t)size * size * 3);
+  BenchConfig scaled = *config;
+  int result = 0;
+
+  if (!rgb) {
+    fwprintf(stderr, L"Failed to allocate a %dx%d image\n", size, size);
+    return -1;
+  }
+
+  /* Keep every size to roughly the same wall time unless --reps is given. */
+  if (scaled.reps == 0) {
+    double reps = 21.0 * (1024.0 * 1024.0) / ((double)size * size);
+    scaled.reps = reps > 21 ? 21 : reps < 3 ? 3 : (int)reps | 1;
+  }
+
+  image->fill(rgb, size, size);
+
+  if (bench_decode(&scaled, image->name, rgb, size) != 0 ||
+      bench_kernels(&scaled, image->name, rgb, size) != 0)
+    result = -1;
+
+  for (int i = 0; result == 0 && i < thread_counts; i++)
+    result = bench_pipeline(&scaled, image->name, rgb, size, threads[i]);
+
+  PG_FREE(rgb);
+  fflush(stdout);
+
+  return result;
+}
+
+static void usage(void) {
+  fwprintf(stderr, L"%s\n",
+           "Usage: pigaco_bench [--max-size <64..16384>] [--threads <n>] "
+           "[--reps <n>] [--image gradient|noise|photo]");
+}
+
+int main(int argc, char **argv) {
+  setlocale(LC_ALL, "en_US.UTF-8");
+
+  BenchConfig config = {4096, 0, (int)sysconf(_SC_NPROCESSORS_ONLN), NULL};
+
+  for (int arg = 1; arg < argc; arg++) {
+    if (arg + 1 >= argc) {
+      usage();
+      return -1;
+    }
+    if (strcmp(argv[arg], "--max-size") == 0)
+      config.max_size = atoi(argv[++arg]);
+    else if (strcmp(argv[arg], "--threads") == 0)
+      config.max_threads = atoi(argv[++arg]);
+    else if (strcmp(argv[arg], "--reps") == 0)
+      config.reps = atoi(argv[++arg]);
+    else if (strcmp(argv[arg], "--image") == 0)
+      config.image = argv[++arg];
+    else {
+      usage();
+      return -1;
+    }
+  }
+
+  if (config.max_size < 64 || config.max_size > 16384 ||
+      config.reps < 0 || config.reps > BENCH_MAX_REPS ||
+      config.max_threads < 1) {
+    usage();
+    return -1;
+  }
+
+  int threads[BENCH_THREAD_COUNTS];
+  int thread_counts = 0;
+  for (int t = 1; t < config.max_threads; t *= 2)
+    threads[thread_counts++] = t;
+  threads[thread_counts++] = config.max_threads;
+
+  if (pg_init(config.max_threads) != 0)
+    return -1;
+
+  wprintf(L"%-24s %-9s %6s %3s %10s %10s %10s %10s\n", "stage", "image",
+          "size", "thr", "median ms", "p99 ms", "MPix/s", "Mcells/s");
+
+  int result = 0;
+  for (int size = 64; result == 0 && size <= config.max_size; size *= 4) {
+    for (size_t i = 0; i < sizeof(bench_images) / sizeof(bench_images[0]);
+         i++) {
+      if (config.image && strcmp(config.image, bench_images[i].name) != 0)
+        continue;
+      if ((result = bench_image(&config, &bench_images[i], size, threads,
+                                thread_counts)) != 0)
+        break;
+    }
+  }
+
+  if (result == 0 && config.max_size >= 4096)
+    result = bench_output(&config);
+
+  pg_shutdown();
+
+  return result == 0 ? 0 : 1;
+}
@@ -0,0 +1,162 @@
+/* Deterministic synthetic test images shared by pigaco_bench,
+ * pigaco_loadgen and pigaco_test. Include after pigaco/converter.h. */
+#ifndef PG_BENCH_IMAGES_H
+#define PG_BENCH_IMAGES_H
+
+typedef void (*bench_fill)(pgu8 *rgb, int width, int height);
+
+typedef struct {
+  const char *name;
+  bench_fill fill;
+} BenchImage;
+
+static pgu32 bench_rand(pgu32 *state) {
+  pgu32 x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+static void fill_gradient(pgu8 *rgb, int width, int height) {
+  for (int y = 0; y < height; y++) {
+    pgu8 *row = rgb + (size_t)y * width * 3;
+    for (int x = 0; x < width; x++) {
+      row[x * 3 + 0] = (pgu8)(x * 255 / (width > 1 ? width - 1 : 1));
+      row[x * 3 + 1] = (pgu8)(y * 255 / (height > 1 ? height - 1 : 1));
+      row[x * 3 + 2] = (pgu8)((x + y) * 255 / (width + height));
+    }
+  }
+}
+
+static void fill_noise(pgu8 *rgb, int width, int height) {
+  pgu32 state = 0x9e3779b9u;
+  size_t size = (size_t)width * height * 3;
+
+  for (size_t i = 0; i < size; i++)
+    rgb[i] = (pgu8)(bench_rand(&state) >> 24);
+}
+
+/* Smooth low-frequency shading, a few hard-edged shapes and a little sensor
+ * noise: close enough to a photograph for branch and cache behaviour. */
+static void fill_photo(pgu8 *rgb, int width, int height) {
+  float *wave_x = (float *)PG_MALLOC((size_t)width * 2 * sizeof(float));
+  float *wave_y = (float *)PG_MALLOC((size_t)height * 2 * sizeof(float));
+  pgu32 state = 0x2545f491u;
+
+  if (!wave_x || !wave_y) {
+    PG_FREE(wave_x);
+    PG_FREE(wave_y);
+    fill_gradient(rgb, width, height);
+    return;
+  }
+
+  for (int x = 0; x < width; x++) {
+    float u = (float)x / width;
+    wave_x[x * 2 + 0] = sinf(u * 6.2831853f * 1.5f);
+    wave_x[x * 2 + 1] = cosf(u * 6.2831853f * 3.0f);
+  }
+  for (int y = 0; y < height; y++) {
+    float v = (float)y / height;
+    wave_y[y * 2 + 0] = cosf(v * 6.2831853f);
+    wave_y[y * 2 + 1] = sinf(v * 6.2831853f * 2.5f);
+  }
+
+  int cx = width / 3, cy = height / 2;
+  int radius = (width < height ? width : height) / 5;
+
+  for (int y = 0; y < height; y++) {
+    pgu8 *row = rgb + (size_t)y * width * 3;
+    for (int x = 0; x < width; x++) {
+      float base = 110.0f + 70.0f * wave_x[x * 2] * wave_y[y * 2] +
+                   30.0f * wave_x[x * 2 + 1] * wave_y[y * 2 + 1];
+      float r = base + 20.0f, g = base, b = base - 25.0f;
+      long dx = x - cx, dy = y - cy;
+
+      if (dx * dx + dy * dy < (long)radius * radius) {
+        r = 230.0f - base * 0.3f;
+        g = 60.0f;
+        b = 40.0f;
+      } else if (x > width * 5 / 8 && y > height / 4 && y < height * 3 / 4) {
+        r *= 0.35f;
+        g *= 0.45f;
+        b = 180.0f;
+      }
+
+      int noise = (int)(bench_rand(&state) >> 28) - 8;
+      int c[3] = {(int)r + noise, (int)g + noise, (int)b + noise};
+      for (int i = 0; i < 3; i++)
+        row[x * 3 + i] = (pgu8)(c[i] < 0 ? 0 : c[i] > 255 ? 255 : c[i]);
+    }
+  }
+
+  PG_FREE(wave_x);
+  PG_FREE(wave_y);
+}
+
+static const BenchImage bench_images[] = {
+    {"gradient", fill_gradient},
+    {"noise", fill_noise},
+    {"photo", fill_photo},
+};
+
+static pgu8 *encode_ppm(const pgu8 *rgb, int width, int height, int *size) {
+  char header[32];
+  int header_len = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width,
+                            height);
+  size_t pixels = (size_t)width * height * 3;
+  pgu8 *data = (pgu8 *)PG_MALLOC(header_len + pixels);
+
+  if (!data)
+    return NULL;
+
+  memcpy(data, header, header_len);
+  memcpy(data + header_len, rgb, pixels);
+  *size = (int)(header_len + pixels);
+
+  return data;
+}
+
+static void put_le(pgu8 *p, pgu32 value, int bytes) {
+  for (int i = 0; i < bytes; i++)
+    p[i] = (pgu8)(value >> (i * 8));
+}
+
+/* 24-bit bottom-up BMP, so decode runs a format that needs per-row work. */
+static pgu8 *encode_bmp(const pgu8 *rgb, int width, int height, int *size) {
+  size_t stride = ((size_t)width * 3 + 3) & ~(size_t)3;
+  size_t total = 54 + stride * height;
+  pgu8 *data = (pgu8 *)PG_MALLOC(total);
+
+  if (!data)
+    return NULL;
+
+  memset(data, 0, 54);
+  data[0] = 'B';
+  data[1] = 'M';
+  put_le(data + 2, (pgu32)total, 4);
+  put_le(data + 10, 54, 4);
+  put_le(data + 14, 40, 4);
+  put_le(data + 18, (pgu32)width, 4);
+  put_le(data + 22, (pgu32)height, 4);
+  put_le(data + 26, 1, 2);
+  put_le(data + 28, 24, 2);
+  put_le(data + 34, (pgu32)(stride * height), 4);
+
+  for (int y = 0; y < height; y++) {
+    const pgu8 *src = rgb + (size_t)(height - 1 - y) * width * 3;
+    pgu8 *dst = data + 54 + stride * y;
+    for (int x = 0; x < width; x++) {
+      dst[x * 3 + 0] = src[x * 3 + 2];
+      dst[x * 3 + 1] = src[x * 3 + 1];
+      dst[x * 3 + 2] = src[x * 3 + 0];
+    }
+    memset(dst + (size_t)width * 3, 0, stride - (size_t)width * 3);
+  }
+  *size = (int)total;
+
+  return data;
+}
+
+#endif // PG_BENCH_IMAGES_H
@@ -5,6 +5,7 @@
 #ifndef PIGACO_CONVERTER_H
 #define PIGACO_CONVERTER_H
 
+#include <stddef.h>
 #include <wchar.h>
 
 #ifndef PGDEF
@@ -26,6 +27,17 @@
 #define ASCII_CHARS L" .,:;irsXA253hMHGS#9B&@"
 #define ASCII_CHARS_LEN ((sizeof(ASCII_CHARS) / sizeof(wchar_t)) - 1)
 
+#define PG_GLYPH_MAX 4
+#define PG_SGR_MAX 19 /* \033[38;2;255;255;255m */
+#define PG_SGR_256_MAX 11 /* \033[38;5;255m */
+#define PG_SGR_16_MAX 5 /* \033[97m */
+#define PG_SGR_16_BG_MAX 6 /* \033[107m */
+#define PG_RESET_LEN 4 /* \033[0m */
+#define PG_HTML_GLYPH_MAX 5 /* &amp; */
+#define PG_HTML_SPAN_MAX 28 /* <span style="color:#rrggbb"> */
+#define PG_HTML_SPAN_BG_MAX 19 /* ;background:#rrggbb */
+#define PG_HTML_CLOSE_LEN 7 /* </span> */
+
 #ifdef PG_CONVERTER_TYPES
 typedef unsigned char pgu8;
 typedef unsigned int pgu32;
@@ -40,23 +52,189 @@ struct Image {
   int width;
   int height;
   int channels;
+  int stride;
   pgu8 *data;
 };
 
+/* Result of the analysis stages, one entry per character cell, kept as
+ * separate planes so encoders and frame diffs touch only what they need. */
+typedef struct {
+  int cols;
+  int rows;
+  pgu8 *glyphs; /* rows x cols index into ASCII_CHARS */
+  pgu8 *fg;     /* rows x cols RGB */
+  pgu8 *bg;     /* rows x cols RGB, NULL for the terminal background */
+} pg_grid;
+
 typedef struct {
   int start_row;
   int end_row;
-  int out_cols;
-  int width;
-  int height;
-  int scale;
-  int vscale;
+  int format;
   int use_color;
-  volatile const pgu8 *image;
-  volatile const pgu8 *gray;
-  wchar_t **out;
+  int merge_colors;
+  int color_tolerance;
+  const pg_grid *grid;
+  char *out;
+  size_t out_stride;
+  size_t *out_lengths;
 } ThreadData;
 
+enum {
+  /* Tone map and dither the full image, then sample one pixel per cell. */
+  PG_PIPELINE_FULL = 0,
+  /* Sample the cell grid first, then tone map and dither only the cells. */
+  PG_PIPELINE_CELLS = 1
+};
+
+enum {
+  PG_SAMPLE_POINT = 0,    /* top-left pixel of each cell */
+  PG_SAMPLE_BOX = 1,      /* mean over the cell */
+  PG_SAMPLE_WEIGHTED = 2  /* tent-weighted mean, favouring the cell centre */
+};
+
+enum {
+  PG_DITHER_NONE = 0,
+  /* Float error diffusion, bit-compatible with floyd__steinberg_dither and
+   * parallelized as a wavefront. */
+  PG_DITHER_FLOYD_STEINBERG = 1,
+  /* Integer error diffusion over a rolling 16-bit error buffer. */
+  PG_DITHER_FS_INTEGER = 2,
+  PG_DITHER_ATKINSON = 3,
+  PG_DITHER_SIERRA_LITE = 4,
+  PG_DITHER_JARVIS = 5,
+  /* Threshold-map dithering: per-pixel independent and stable between
+   * frames. */
+  PG_DITHER_BAYER4 = 6,
+  PG_DITHER_BAYER8 = 7,
+  PG_DITHER_BLUE_NOISE = 8
+};
+
+enum {
+  PG_COLOR_NONE = 0,
+  PG_COLOR_TRUECOLOR = 1,
+  PG_COLOR_256 = 2,
+  PG_COLOR_16 = 3
+};
+
+enum {
+  PG_FORMAT_ANSI = 0,
+  /* One line of <span>s per row, to be placed inside a <pre>. */
+  PG_FORMAT_HTML = 1,
+  /* Analysis only: the converter fills its grid and renders no frame. */
+  PG_FORMAT_NONE = 2
+};
+
+typedef struct {
+  int scale;
+  float aspect_ratio;
+  int pipeline; /* PG_PIPELINE_* */
+  int sampling; /* PG_SAMPLE_* */
+  int dither;   /* PG_DITHER_* */
+  /* Tone curve, applied in this order and baked into one 256-entry table:
+   * input levels, gamma, contrast around 128, brightness offset. */
+  int black_level;
+  int white_level;
+  float gamma;
+  float contrast;
+  float brightness;
+  int use_color; /* PG_COLOR_* */
+  /* Only emit a color escape when the color differs from the last one by
+   * more than color_tolerance in any channel, and reset once per line. */
+  int merge_colors;
+  int color_tolerance;
+  int format; /* PG_FORMAT_* */
+  /* Upper bound on worker threads; 0 picks from the cell count. */
+  int threads;
+} pg_options;
+
+typedef struct {
+  int (*read)(void *user, char *data, int size);
+  void (*skip)(void *user, int n);
+  int (*eof)(void *user);
+} pg_io_callbacks;
+
+typedef struct {
+  char *data;
+  size_t size;
+  size_t *row_offsets;
+  int rows;
+} pg_frame;
+
+enum {
+  PG_STAGE_DECODE = 0,
+  PG_STAGE_TONE = 1,
+  PG_STAGE_GRAY = 2,
+  PG_STAGE_SAMPLE = 3,
+  PG_STAGE_DITHER = 4,
+  PG_STAGE_RENDER = 5,
+  PG_STAGE_WRITE = 6,
+  PG_STAGE_COUNT = 7
+};
+
+enum {
+  PG_COUNTER_CYCLES = 0,
+  PG_COUNTER_INSTRUCTIONS = 1,
+  PG_COUNTER_L1D_MISSES = 2, /* L1 data cache read misses */
+  PG_COUNTER_LLC_MISSES = 3, /* last level cache read misses */
+  PG_COUNTER_BRANCH_MISSES = 4,
+  PG_COUNTER_COUNT = 5
+};
+
+/* Filled by a converter with stats enabled. Stage times are wall clock;
+ * contrast and the rest of the tone curve are applied in the gray (or
+ * sample) pass, tone_ns only covers building the table. */
+typedef struct {
+  unsigned long long decode_ns;
+  unsigned long long tone_ns;
+  unsigned long long gray_ns;
+  unsigned long long sample_ns;
+  unsigned long long dither_ns;
+  unsigned long long render_ns;
+  unsigned long long write_ns;
+  size_t bytes;       /* frame size */
+  size_t cells;
+  /* Made on the calling thread during the conversion, decoding included. */
+  size_t allocations;
+  size_t allocated_bytes;
+  size_t pixels;
+  int threads;
+  /* Per PG_STAGE_* and PG_COUNTER_*, summed over the calling thread and the
+   * pool workers; -1 for events the CPU or kernel does not offer. Only
+   * filled with counters enabled. */
+  int counters_enabled;
+  long long counters[PG_STAGE_COUNT][PG_COUNTER_COUNT];
+} pg_stats;
+
+/* Everything the library allocates, stb_image decoding included, goes
+ * through one of these. realloc must accept NULL; free may get NULL. */
+typedef struct {
+  void *(*allocate)(void *user, size_t size);
+  void *(*reallocate)(void *user, void *ptr, size_t size);
+  void (*deallocate)(void *user, void *ptr);
+  void *user;
+} pg_allocator;
+
+/* State of a counting allocator. Updated atomically, so one may be shared
+ * between threads. */
+typedef struct {
+  size_t limit;  /* most live bytes allowed, 0 for no limit */
+  size_t count;  /* allocations and reallocations */
+  size_t bytes;  /* bytes they asked for */
+  size_t live;   /* bytes allocated and not yet freed */
+  size_t peak;   /* highest live */
+  size_t failed; /* allocations refused by limit or by the system */
+} pg_counting;
+
+typedef struct pg_pool pg_pool;
+
+typedef struct pg_arena pg_arena;
+
+typedef struct pg_converter pg_converter;
+
+typedef struct pg_encoder pg_encoder;
+
+typedef void (*pg_task)(void *arg, int thread_index, int num_threads);
+
 #ifdef __cplusplus
 extern "C" {
 #endif // __cplusplus
@@ -70,11 +248,192 @@ PGDEF pg_inline void apply__contrast(pgu8 *gray, int width, int height,
 
 PGDEF pg_inline void floyd__steinberg_dither(pgu8 *gray, int width, int height);
 
+/* Same result as floyd__steinberg_dither, computed as a wavefront on the
+ * pool: row y advances while row y - 1 is at least three pixels ahead. */
+PGDEF void floyd__steinberg_dither_wavefront(pg_pool *pool, pgu8 *gray,
+                                             int width, int height);
+
 PGDEF void *process__rows(void *arg);
 
 PGDEF void convert_image_to_ascii(const char *filename, int scale,
                                   float aspect_ratio);
 
+/* Persistent worker pool. num_threads <= 0 means one thread per online CPU;
+ * the calling thread always takes part as thread 0. */
+PGDEF pg_pool *pg_pool_create(int num_threads);
+
+PGDEF void pg_pool_destroy(pg_pool *pool);
+
+PGDEF int pg_pool_size(const pg_pool *pool);
+
+/* Runs task on the calling thread and every idle worker of the pool and
+ * returns once all are done. Concurrent callers split the workers between
+ * them instead of waiting for each other. */
+PGDEF void pg_pool_run(pg_pool *pool, pg_task task, void *arg);
+
+/* Nanoseconds each thread spent running tasks since the pool was created or
+ * last reset, busy_ns holding pg_pool_size entries. Call between runs. */
+PGDEF void pg_pool_busy(const pg_pool *pool, unsigned long long *busy_ns);
+
+PGDEF void pg_pool_reset_busy(pg_pool *pool);
+
+/* (Re)creates the pool shared by convert_image_to_ascii and by converters
+ * and encoders created with a NULL pool, which pick the new one up on their
+ * next call. Must not be called while a conversion is running. */
+PGDEF int pg_init(int num_threads);
+
+/* Destroys the shared pool, which the next call needing it recreates, and
+ * stops tracing. */
+PGDEF void pg_shutdown(void);
+
+/* Sets the allocator used from now on by pools, converters and encoders
+ * created without one, grids and tracing; NULL restores malloc. Objects keep
+ * the allocator they were created with. Must not be called while anything
+ * is allocating or while grids or a trace allocated with the previous one
+ * are alive. */
+PGDEF void pg_set_allocator(const pg_allocator *allocator);
+
+/* An allocator over malloc that keeps counting up to date and fails
+ * allocations that would take it over counting->limit. counting must
+ * outlive everything allocated through it. */
+PGDEF pg_allocator pg_counting_allocator(pg_counting *counting);
+
+/* Starts a new measurement: zeroes count, bytes and failed and sets peak to
+ * what is live now. */
+PGDEF void pg_counting_reset(pg_counting *counting);
+
+/* Bump allocator for buffers that are all released together. Each thread
+ * allocating from it gets its own chain of blocks, so threads never contend
+ * after their first allocation. Freeing only gives back the calling
+ * thread's newest allocation; everything else waits for pg_arena_reset.
+ * Blocks come from the allocator current at creation. When that is malloc,
+ * large blocks are mmapped instead and advised for transparent huge pages.
+ * block_size is the first block of each thread, 0 for a default. */
+PGDEF pg_arena *pg_arena_create(size_t block_size);
+
+PGDEF void pg_arena_destroy(pg_arena *arena);
+
+/* Releases every allocation. A thread that needed several blocks gets them
+ * merged into one, so the next cycle of the same size allocates nothing,
+ * and one whose block is over four times what it used gets a smaller one.
+ * Must not run while any thread allocates from the arena. */
+PGDEF void pg_arena_reset(pg_arena *arena);
+
+PGDEF pg_allocator pg_arena_allocator(pg_arena *arena);
+
+/* Bytes held in blocks. */
+PGDEF size_t pg_arena_reserved(pg_arena *arena);
+
+/* Records a begin/end event for every stage and every row chunk a thread
+ * claims, until pg_trace_stop (or pg_shutdown) writes them to path as
+ * Chrome trace-event JSON for chrome://tracing or Perfetto. Neither may be
+ * called while a conversion is running. */
+PGDEF int pg_trace_start(const char *path);
+
+PGDEF int pg_trace_stop(void);
+
+/* Conversion context. Owns every buffer a conversion needs and only grows
+ * them, and decodes into a scratch arena reset after every conversion, so
+ * repeated conversions of same-sized images do not allocate.
+ * pool may be NULL to use the shared pool, looked up on every call so
+ * pg_init and pg_shutdown may replace it in between. Not safe to share
+ * between threads. */
+PGDEF pg_converter *pg_converter_create(pg_pool *pool);
+
+/* Same, with every buffer of the converter and of its conversions, decoding
+ * included, coming from allocator. */
+PGDEF pg_converter *pg_converter_create_with_allocator(
+    pg_pool *pool, const pg_allocator *allocator);
+
+PGDEF void pg_converter_destroy(pg_converter *conv);
+
+PGDEF pg_options pg_default_options(void);
+
+/* Number of bytes a frame of a width x height image needs. */
+PGDEF size_t pg_output_size(int width, int height, const pg_options *opts);
+
+/* Renders into caller memory of size bytes instead of converter-owned
+ * memory. Pass NULL to switch back. */
+PGDEF void pg_converter_set_output(pg_converter *conv, char *buffer,
+                                   size_t size);
+
+PGDEF int pg_convert_file(pg_converter *conv, const char *filename,
+                          const pg_options *opts);
+
+/* Converts already decoded pixels: 1 (gray), 2 (gray + alpha), 3 (RGB) or 4
+ * (RGBA) channels, rows stride bytes apart (0 for tightly packed, otherwise
+ * at least width * channels; bottom-up layouts are not supported). Alpha is
+ * ignored. */
+PGDEF int pg_convert_pixels(pg_converter *conv, const pgu8 *pixels, int width,
+                            int height, int channels, int stride,
+                            const pg_options *opts);
+
+/* Converts an encoded image (any format stb_image decodes). */
+PGDEF int pg_convert_memory(pg_converter *conv, const pgu8 *buffer, int size,
+                            const pg_options *opts);
+
+PGDEF int pg_convert_callbacks(pg_converter *conv,
+                               const pg_io_callbacks *callbacks, void *user,
+                               const pg_options *opts);
+
+/* Last converted frame: UTF-8, every row terminated by '\n', row i spanning
+ * [row_offsets[i], row_offsets[i + 1]) and data NUL-terminated. Valid until
+ * the next conversion. */
+PGDEF const pg_frame *pg_converter_frame(const pg_converter *conv);
+
+PGDEF int pg_frame_write(const pg_frame *frame, int fd);
+
+/* Records per-stage timings for every following conversion. Off by
+ * default. */
+PGDEF void pg_converter_set_stats(pg_converter *conv, int enable);
+
+/* Also counts the PG_COUNTER_* events of every stage with perf_event_open,
+ * on the calling thread and on each pool worker, so work the workers do for
+ * other converters sharing the pool is counted too. Enables stats; disabling
+ * stats disables counters. Returns -1, leaving counters off, when none of
+ * the events can be opened. */
+PGDEF int pg_converter_set_counters(pg_converter *conv, int enable);
+
+/* Stats of the last conversion (and write), or NULL when disabled. */
+PGDEF const pg_stats *pg_converter_stats(const pg_converter *conv);
+
+/* pg_frame_write of the last frame, timed into the stats. */
+PGDEF int pg_converter_write(pg_converter *conv, int fd);
+
+PGDEF void pg_stats_print(const pg_stats *stats);
+
+/* Grid of the last conversion. Valid until the next conversion. */
+PGDEF const pg_grid *pg_converter_grid(const pg_converter *conv);
+
+/* Copies src into dst, reallocating dst's planes when the size or the
+ * presence of bg changes. dst must be zeroed or a previous copy target. */
+PGDEF int pg_grid_copy(pg_grid *dst, const pg_grid *src);
+
+PGDEF void pg_grid_free(pg_grid *grid);
+
+/* Number of rows that differ between a and b, or -1 if their sizes do.
+ * changed, if not NULL, receives one flag per row. */
+PGDEF int pg_grid_diff(const pg_grid *a, const pg_grid *b, pgu8 *changed);
+
+/* Turns grids into frames, independently of any converter, so encoding can
+ * run on another thread than analysis. pool may be NULL to use the shared
+ * pool, looked up on every call like a converter's. */
+PGDEF pg_encoder *pg_encoder_create(pg_pool *pool);
+
+PGDEF void pg_encoder_destroy(pg_encoder *enc);
+
+PGDEF void pg_encoder_set_output(pg_encoder *enc, char *buffer, size_t size);
+
+/* Number of bytes encoding grid with opts needs. */
+PGDEF size_t pg_encode_size(const pg_grid *grid, const pg_options *opts);
+
+/* Encodes grid with opts->use_color, merge_colors, color_tolerance and
+ * format. */
+PGDEF int pg_encode(pg_encoder *enc, const pg_grid *grid,
+                    const pg_options *opts);
+
+PGDEF const pg_frame *pg_encoder_frame(const pg_encoder *enc);
+
 PGDEF pg_inline const pgu32 pg_version();
 
 #ifdef __cplusplus
@@ -93,20 +452,127 @@ PGDEF pg_inline const pgu32 pg_version();
 
 #ifdef PG_CONVERTER_IMPLEMENTATION
 
+#include <errno.h>
 #include <math.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
+/* syscall and MAP_ANONYMOUS need the default feature set, which a strict
+ * -std=c11 build only gets with _DEFAULT_SOURCE; without it the code below
+ * falls back to portable C11 and POSIX. */
+#if !defined(__STRICT_ANSI__) || defined(_DEFAULT_SOURCE) ||                  \
+    defined(_GNU_SOURCE)
+#define PG_SYSCALL
+#endif
+
+#if defined(__linux__) && defined(PG_SYSCALL) && !defined(PG_NO_PERF)
+#define PG_PERF
+#include <linux/perf_event.h>
+#endif
+
 #define PG_CONVERTER_TYPES
 
+static void *pg__libc_allocate(void *user, size_t size) {
+  (void)user;
+  return malloc(size);
+}
+
+static void *pg__libc_reallocate(void *user, void *ptr, size_t size) {
+  (void)user;
+  return realloc(ptr, size);
+}
+
+static void pg__libc_deallocate(void *user, void *ptr) {
+  (void)user;
+  free(ptr);
+}
+
+static pg_allocator pg__global_allocator = {
+    pg__libc_allocate, pg__libc_reallocate, pg__libc_deallocate, NULL};
+
+/* Allocator of the object whose entry point this thread is in, NULL outside
+ * of one. */
+static __thread const pg_allocator *pg__allocator = NULL;
+
+/* Allocations made on this thread, for pg_stats. */
+static __thread size_t pg__allocations = 0;
+static __thread size_t pg__allocated_bytes = 0;
+
+/* Makes allocator current on this thread (NULL for the global one) and
+ * returns the one it replaces. */
+static const pg_allocator *pg__use(const pg_allocator *allocator) {
+  const pg_allocator *previous = pg__allocator;
+  pg__allocator = allocator;
+  return previous;
+}
+
+static const pg_allocator *pg__current_allocator(void) {
+  return pg__allocator ? pg__allocator : &pg__global_allocator;
+}
+
+static void *pg__malloc(size_t size) {
+  const pg_allocator *allocator = pg__current_allocator();
+
+  pg__allocations++;
+  pg__allocated_bytes += size;
+
+  return allocator->allocate(allocator->user, size);
+}
+
+static void *pg__realloc(void *ptr, size_t size) {
+  const pg_allocator *allocator = pg__current_allocator();
+
+  pg__allocations++;
+  pg__allocated_bytes += size;
+
+  return allocator->reallocate(allocator->user, ptr, size);
+}
+
+static void pg__free(void *ptr) {
+  if (!ptr)
+    return;
+
+  const pg_allocator *allocator = pg__current_allocator();
+  allocator->deallocate(allocator->user, ptr);
+}
+
+#define PG_MALLOC(size) pg__malloc(size)
+#define PG_REALLOC(ptr, size) pg__realloc(ptr, size)
+#define PG_FREE(ptr) pg__free(ptr)
+
+#define STBI_MALLOC(size) PG_MALLOC(size)
+#define STBI_REALLOC(ptr, size) PG_REALLOC(ptr, size)
+#define STBI_FREE(ptr) PG_FREE(ptr)
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb/stb_image.h"
 
-#define PG_MALLOC(size) malloc(size)
-#define PG_FREE(ptr) free(ptr)
+#if defined(__SSE2__) && !defined(PG_NO_SIMD)
+#define PG_SSE2
+#include <emmintrin.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) &&                              \
+    (defined(__GNUC__) || defined(__clang__)) && !defined(PG_NO_SIMD)
+#define PG_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#define PG_PROGRESS_STRIDE 16 /* ints per wavefront row counter */
+#define PG_CHUNKS_PER_THREAD 8 /* row chunks handed out per thread and job */
+#define PG_THREAD_MIN_NS 100000 /* least work worth waking a thread for */
+#define PG_CELL_NS 4000.0 /* per cell with default options, until measured */
+#define PG_TRACE_EVENTS 65536 /* events kept per thread while tracing */
+#define PG_ARENA_BLOCK (64u << 10) /* first arena block of each thread */
+#define PG_ARENA_HUGE (2u << 20) /* arena blocks mmapped from this size */
+#define PG_ARENA_ALIGN 16 /* also the size header of each allocation */
 
 #ifdef __cplusplus
 extern "C" {
@@ -116,189 +582,3279 @@ extern "C" {
 using namespace pg;
 #endif // __cplusplus
 
-PGDEF void convert_image_to_ascii(const char *filename, int scale,
-                                  float aspect_ratio) {
-  struct Image *image = (struct Image *)PG_MALLOC(sizeof(struct Image));
+/* One pg__pool_run_n call, on its caller's stack. */
+typedef struct {
+  pg_task task;
+  void *arg;
+  int num_threads; /* the caller and the workers it was handed */
+  int pending;     /* workers still running */
+  unsigned long long run_ns; /* work done by the workers */
+} PoolJob;
 
-  image->data =
-      stbi_load(filename, &image->width, &image->height, &image->channels, 3);
+typedef struct {
+  pg_pool *pool;
+  int index;
+  pthread_cond_t wake; /* signalled only when a job needs this worker */
+  PoolJob *job;        /* NULL while idle */
+  int job_index;       /* thread_index within job */
+  unsigned long long busy_ns;
+  int tid; /* set by the worker once it runs */
+} PoolWorker;
+
+struct pg_pool {
+  int num_threads;
+  pthread_t *threads;
+  PoolWorker *workers;
+  int *idle; /* indices of idle workers, most recently used last */
+  int idle_count;
+  pthread_mutex_t lock;
+  pthread_cond_t done; /* broadcast whenever a job's last worker finishes */
+  unsigned id; /* unique among pools, so a replaced one can be told apart */
+  int shutdown;
+  pg_allocator allocator;
+};
 
-  if (!image) {
-    fwprintf(stderr, L"%s\n", stbi_failure_reason());
+static unsigned long long pg__pool_run_n(pg_pool *pool, int num_threads,
+                                         pg_task task, void *arg);
 
-    PG_FREE(image);
+/* perf_event fds for the calling thread (row 0) and each pool worker, one
+ * per PG_COUNTER_*, -1 where the event could not be opened. */
+typedef struct {
+  int threads;
+  int caller;
+  unsigned pool_id;
+  int *fds;
+  long long last[PG_COUNTER_COUNT];
+} PerfCounters;
+
+struct pg_encoder {
+  pg_pool *user_pool; /* as created, NULL for the shared pool */
+  pg_pool *pool;      /* pool of the current call */
+  char *bytes;
+  size_t bytes_size;
+  char *user_bytes;
+  size_t user_bytes_size;
+  size_t *row_offsets;
+  size_t row_offsets_size;
+  pg_frame frame;
+  double cell_ns;
+  int threads;
+  unsigned long long work_ns;
+  pg_allocator allocator;
+};
 
-    return;
-  }
+struct pg_converter {
+  pg_pool *user_pool; /* as created, NULL for the shared pool */
+  pg_pool *pool;      /* pool of the current call */
+  pgu8 *gray;
+  size_t gray_size;
+  pgu8 *cells;
+  size_t cells_size;
+  pgu8 *colors;
+  size_t colors_size;
+  pgu32 *sums;
+  size_t sums_size;
+  int *progress;
+  size_t progress_size;
+  short *errors;
+  size_t errors_size;
+  pg_grid grid;
+  struct pg_encoder encoder;
+  double cell_ns;             /* estimated work per cell */
+  int threads;                /* threads used by the current conversion */
+  unsigned long long work_ns; /* work done so far, summed over threads */
+  int stats_enabled;
+  pg_stats stats;
+  size_t allocations;     /* pg__allocations when the conversion began */
+  size_t allocated_bytes; /* pg__allocated_bytes likewise */
+  PerfCounters *perf;
+  pg_allocator allocator;
+  pg_arena *scratch; /* decoder allocations, reset after each conversion */
+  pg_allocator scratch_allocator;
+};
 
-  pgu8 *gray = (pgu8 *)PG_MALLOC(image->width * image->height);
-  if (!gray) {
-    wprintf(L"Error allocate memory for gray.\n");
+static void pg__run(pg_converter *conv, pg_task task, void *arg) {
+  conv->work_ns += pg__pool_run_n(conv->pool, conv->threads, task, arg);
+}
 
-    stbi_image_free(image->data);
+/* A threshold map, each row repeated out to 32 bytes so the SIMD path can
+ * load 16 thresholds at any x that is a multiple of 16. */
+typedef struct {
+  const pgu8 *rows;
+  int mask;
+} OrderedMap;
+
+typedef struct {
+  const struct Image *image;
+  pgu8 *gray;
+  const pgu8 *tone;
+  const OrderedMap *ordered;
+  int next_row;
+} GrayData;
+
+typedef struct {
+  const struct Image *image;
+  const pgu8 *gray; /* full-resolution plane, NULL to take luma + tone */
+  const pgu8 *tone;
+  pgu8 *cells;
+  pgu8 *colors;
+  int out_rows;
+  int out_cols;
+  int scale;
+  int vscale;
+  int sampling;
+  pgu32 *sums; /* per thread: width * (channels + 1) column sums */
+  const OrderedMap *ordered;
+  int glyphs; /* turn cells into glyph indices once sampled */
+  int next_row;
+} SampleData;
+
+static char pg__dec[256][4];
+static char pg__glyphs[ASCII_CHARS_LEN][PG_GLYPH_MAX + 1];
+static char pg__html_glyphs[ASCII_CHARS_LEN][PG_HTML_GLYPH_MAX + 1];
+static pgu8 pg__glyph_index[256];
+static pthread_once_t pg__tables_once = PTHREAD_ONCE_INIT;
+
+/* Nearest palette entry for every 5:5:5 RGB value, built on first use. */
+static pgu8 pg__palette_256[32 * 32 * 32];
+static pgu8 pg__palette_16[32 * 32 * 32];
+static pthread_once_t pg__palette_256_once = PTHREAD_ONCE_INIT;
+static pthread_once_t pg__palette_16_once = PTHREAD_ONCE_INIT;
+
+typedef void (*pg_gray_kernel)(const pgu8 *rgb, pgu8 *gray, int count);
+
+static pg_gray_kernel pg__gray_rgb = NULL;
+
+static pgu8 pg__bayer4[4][32];
+static pgu8 pg__bayer8[8][32];
+static pgu8 pg__blue_noise[32][32];
+static pthread_once_t pg__blue_noise_once = PTHREAD_ONCE_INIT;
+static int pg__ordered_simd = 0;
+static int pg__cpus = 0;
+
+typedef struct {
+  pgu8 *gray;
+  int width;
+  int height;
+  int *progress; /* pixels finished per row, PG_PROGRESS_STRIDE apart */
+  int next_row;
+} DitherData;
+
+typedef struct {
+  signed char dx;
+  signed char dy;
+  signed char weight;
+} DitherTap;
+
+typedef struct {
+  const DitherTap *taps;
+  int count;
+  int divisor;
+} DitherKernel;
+
+static const DitherTap pg__fs_taps[] = {
+    {1, 0, 7}, {-1, 1, 3}, {0, 1, 5}, {1, 1, 1}};
+static const DitherTap pg__atkinson_taps[] = {
+    {1, 0, 1}, {2, 0, 1}, {-1, 1, 1}, {0, 1, 1}, {1, 1, 1}, {0, 2, 1}};
+static const DitherTap pg__sierra_lite_taps[] = {
+    {1, 0, 2}, {-1, 1, 1}, {0, 1, 1}};
+static const DitherTap pg__jarvis_taps[] = {
+    {1, 0, 7},  {2, 0, 5},  {-2, 1, 3}, {-1, 1, 5}, {0, 1, 7},  {1, 1, 5},
+    {2, 1, 3},  {-2, 2, 1}, {-1, 2, 3}, {0, 2, 5},  {1, 2, 3},  {2, 2, 1}};
+
+static const DitherKernel pg__kernels[] = {
+    {pg__fs_taps, 4, 16},
+    {pg__atkinson_taps, 6, 8},
+    {pg__sierra_lite_taps, 3, 4},
+    {pg__jarvis_taps, 12, 48}};
+
+static pg_pool *pg__pool = NULL;
+static unsigned pg__pool_ids = 0;
+static pg_converter *pg__converter = NULL;
+static pthread_mutex_t pg__pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pg__converter_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long long pg__now_ns(void) {
+  struct timespec ts;
+#ifdef CLOCK_MONOTONIC
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+  timespec_get(&ts, TIME_UTC);
+#endif
+  return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int pg__gettid(void) {
+#if defined(PG_SYSCALL) && defined(SYS_gettid)
+  return (int)syscall(SYS_gettid);
+#else
+  static int next = 1;
+  static __thread int tid = 0;
 
-    PG_FREE(image);
+  if (!tid)
+    tid = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED);
+  return tid;
+#endif
+}
+
+/* Tracing: every thread appends complete events to a buffer only it
+ * writes, published with a release store of the count. Buffers are pushed
+ * onto a lock-free list on first use and read back when the trace is
+ * stopped, which must not happen while a conversion is running. */
+typedef struct {
+  const char *name;
+  unsigned long long start_ns;
+  unsigned long long end_ns;
+  int begin_row; /* -1 for stage events */
+  int end_row;
+} TraceEvent;
+
+typedef struct TraceBuffer {
+  struct TraceBuffer *next;
+  int tid;
+  int worker; /* pool thread index, -1 for other threads */
+  size_t count;
+  size_t dropped;
+  TraceEvent events[PG_TRACE_EVENTS];
+} TraceBuffer;
+
+static int pg__trace_enabled = 0;
+static unsigned pg__trace_generation = 0;
+static TraceBuffer *pg__trace_buffers = NULL;
+static char *pg__trace_path = NULL;
+static __thread TraceBuffer *pg__trace_buffer = NULL;
+static __thread unsigned pg__trace_buffer_generation = 0;
+static __thread int pg__trace_worker = -1;
+
+static unsigned long long pg__trace_now(void) {
+  return __atomic_load_n(&pg__trace_enabled, __ATOMIC_RELAXED) ? pg__now_ns()
+                                                               : 0;
+}
+
+static void pg__trace(const char *name, unsigned long long start_ns,
+                      int begin_row, int end_row) {
+  if (!start_ns || !__atomic_load_n(&pg__trace_enabled, __ATOMIC_ACQUIRE))
+    return;
 
+  unsigned generation =
+      __atomic_load_n(&pg__trace_generation, __ATOMIC_ACQUIRE);
+  TraceBuffer *buffer = pg__trace_buffer;
+
+  if (!buffer || pg__trace_buffer_generation != generation) {
+    /* Trace buffers outlive the conversion that starts them. */
+    const pg_allocator *previous = pg__use(NULL);
+    buffer = (TraceBuffer *)PG_MALLOC(sizeof(TraceBuffer));
+    pg__use(previous);
+    if (!buffer)
+      return;
+
+    buffer->tid = pg__gettid();
+    buffer->worker = pg__trace_worker;
+    buffer->count = 0;
+    buffer->dropped = 0;
+    buffer->next = __atomic_load_n(&pg__trace_buffers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&pg__trace_buffers, &buffer->next,
+                                        buffer, 1, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED))
+      ;
+
+    pg__trace_buffer = buffer;
+    pg__trace_buffer_generation = generation;
+  }
+
+  size_t count = buffer->count;
+  if (count == PG_TRACE_EVENTS) {
+    buffer->dropped++;
     return;
   }
 
-  for (int i = 0; i < image->width * image->height * 3; i += 3)
-    gray[i / 3] = (pgu8)(0.299f * image->data[i] + 0.587f * image->data[i + 1] +
-                         0.114f * image->data[i + 2]);
+  TraceEvent *event = &buffer->events[count];
+  event->name = name;
+  event->start_ns = start_ns;
+  event->end_ns = pg__now_ns();
+  event->begin_row = begin_row;
+  event->end_row = end_row;
 
-  apply__contrast(gray, image->width, image->height, 1.1f);
+  __atomic_store_n(&buffer->count, count + 1, __ATOMIC_RELEASE);
+}
 
-  floyd__steinberg_dither(gray, image->width, image->height);
+/* Per-task state for tracing the chunks a thread claims. */
+typedef struct {
+  const char *name;
+  unsigned long long start_ns;
+} ChunkTrace;
+
+/* Rows are claimed in chunks from a shared counter rather than split up
+ * front, so threads that get cheap rows or more CPU time take more of
+ * them. */
+static int pg__chunk(int count, int num_threads) {
+  int chunk = count / (num_threads * PG_CHUNKS_PER_THREAD);
+  return chunk < 1 ? 1 : chunk;
+}
 
-  int vscale = (int)(scale / aspect_ratio);
-  vscale = vscale < 1 ? 1 : vscale;
+/* Also closes the trace event of the chunk claimed before, which
+ * *begin and *end still describe. */
+static int pg__claim(int *next, int count, int chunk, int *begin, int *end,
+                     ChunkTrace *trace) {
+  if (trace->start_ns)
+    pg__trace(trace->name, trace->start_ns, *begin, *end);
+
+  int row = __atomic_fetch_add(next, chunk, __ATOMIC_RELAXED);
+  if (row >= count)
+    return 0;
+
+  *begin = row;
+  *end = row + chunk < count ? row + chunk : count;
+  trace->start_ns = pg__trace_now();
+  return 1;
+}
 
-  int use_color = 1;
+/* Enough threads that each gets about PG_THREAD_MIN_NS of the expected
+ * work, so small frames stay on the calling thread. Never more than there
+ * are CPUs: threads waiting on each other would count their waits as work
+ * and push the estimate up. opts->threads > 0 overrides the estimate. */
+static int pg__threads(pg_pool *pool, const pg_options *opts, size_t cells,
+                       double cell_ns) {
+  int threads = pg_pool_size(pool);
 
-  int out_rows = (image->height + vscale - 1) / vscale;
-  int out_cols = (image->width + scale - 1) / scale;
+  if (opts->threads > 0)
+    return opts->threads < threads ? opts->threads : threads;
 
-  wchar_t **output = (wchar_t **)PG_MALLOC(out_rows * sizeof(wchar_t *));
-  memset(output, 0, out_rows * sizeof(wchar_t *));
+  if (pg__cpus > 0 && pg__cpus < threads)
+    threads = pg__cpus;
 
-  int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
-  pthread_t *threads = (pthread_t *)PG_MALLOC(num_threads * sizeof(pthread_t));
-  ThreadData *thread_data =
-      (ThreadData *)PG_MALLOC(num_threads * sizeof(ThreadData));
+  double wanted = cells * cell_ns / PG_THREAD_MIN_NS;
+  if (wanted < threads)
+    threads = wanted < 1 ? 1 : (int)wanted;
 
-  wprintf(L"Using %d thread(s)\n", num_threads);
+  return threads;
+}
 
-  int rows_per_thread = out_rows / num_threads;
-  int extra_rows = out_rows % num_threads;
-  int current_row = 0;
+/* Moves the per-cell estimate a quarter of the way to what was measured. */
+static double pg__calibrate(double cell_ns, unsigned long long work_ns,
+                            size_t cells) {
+  if (cells == 0)
+    return cell_ns;
 
-  for (int i = 0; i < num_threads; i++) {
-    thread_data[i].start_row = current_row;
-    thread_data[i].end_row = current_row + rows_per_thread + (i < extra_rows);
-    thread_data[i].out_cols = out_cols;
-    thread_data[i].width = image->width;
-    thread_data[i].height = image->height;
-    thread_data[i].scale = scale;
-    thread_data[i].vscale = vscale;
-    thread_data[i].use_color = use_color;
-    thread_data[i].image = image->data;
-    thread_data[i].gray = gray;
-    thread_data[i].out = output;
-    current_row = thread_data[i].end_row;
-
-    if (pthread_create(&threads[i], NULL, process__rows, &thread_data[i]) != 0)
-      fwprintf(stderr, L"Error create thread %d\n", i);
+  return cell_ns + ((double)work_ns / cells - cell_ns) * 0.25;
+}
+
+#ifdef PG_PERF
+static int pg__perf_open(int counter, int tid) {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  if (counter == PG_COUNTER_L1D_MISSES || counter == PG_COUNTER_LLC_MISSES) {
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = (counter == PG_COUNTER_L1D_MISSES ? PERF_COUNT_HW_CACHE_L1D
+                                                    : PERF_COUNT_HW_CACHE_LL) |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  } else {
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = counter == PG_COUNTER_CYCLES ? PERF_COUNT_HW_CPU_CYCLES
+                  : counter == PG_COUNTER_INSTRUCTIONS
+                      ? PERF_COUNT_HW_INSTRUCTIONS
+                      : PERF_COUNT_HW_BRANCH_MISSES;
   }
 
-  for (int i = 0; i < num_threads; i++)
-    pthread_join(threads[i], NULL);
+  return (int)syscall(SYS_perf_event_open, &attr, tid, -1, -1,
+                      PERF_FLAG_FD_CLOEXEC);
+}
+
+/* Sums each event over all threads, scaled up for any time the kernel had
+ * it multiplexed out. */
+static void pg__perf_read(const PerfCounters *perf,
+                          long long counts[PG_COUNTER_COUNT]) {
+  for (int c = 0; c < PG_COUNTER_COUNT; c++)
+    counts[c] = perf->fds[c] >= 0 ? 0 : -1;
 
-  for (int i = 0; i < out_rows; i++) {
-    if (output[i]) {
-      wprintf(L"%ls\n", output[i]);
+  for (int t = 0; t < perf->threads; t++) {
+    for (int c = 0; c < PG_COUNTER_COUNT; c++) {
+      int fd = perf->fds[t * PG_COUNTER_COUNT + c];
+      unsigned long long value[3]; /* count, time enabled, time running */
 
-      PG_FREE(output[i]);
+      if (fd < 0 || read(fd, value, sizeof(value)) != sizeof(value) ||
+          value[2] == 0)
+        continue;
+
+      counts[c] += (long long)((double)value[0] * value[1] / value[2]);
     }
   }
+}
 
-  PG_FREE(output);
-  PG_FREE(threads);
-  PG_FREE(thread_data);
-  PG_FREE(gray);
+static void pg__perf_destroy(PerfCounters *perf) {
+  if (!perf)
+    return;
 
-  stbi_image_free(image->data);
+  for (int i = 0; i < perf->threads * PG_COUNTER_COUNT; i++)
+    if (perf->fds[i] >= 0)
+      close(perf->fds[i]);
 
-  PG_FREE(image);
+  PG_FREE(perf->fds);
+  PG_FREE(perf);
 }
 
-PGDEF void apply__contrast(pgu8 *gray, int width, int height, float contrast) {
-  int size = width * height;
-  for (int i = 0; i < size; i++) {
-    float val = gray[i];
+static PerfCounters *pg__perf_create(pg_pool *pool) {
+  PerfCounters *perf = (PerfCounters *)PG_MALLOC(sizeof(PerfCounters));
+  if (!perf)
+    return NULL;
+
+  perf->threads = pool->num_threads;
+  perf->caller = pg__gettid();
+  perf->pool_id = pool->id;
+  perf->fds =
+      (int *)PG_MALLOC((size_t)perf->threads * PG_COUNTER_COUNT * sizeof(int));
+  if (!perf->fds) {
+    PG_FREE(perf);
+    return NULL;
+  }
 
-    val = (val - 128.0f) * contrast + 128.0f;
-    if (val < 0)
-      val = 0;
-    if (val > 255)
-      val = 255;
-    gray[i] = (pgu8)val;
+  int opened = 0, error = 0;
+
+  for (int t = 0; t < perf->threads; t++) {
+    int tid = perf->caller;
+
+    if (t > 0)
+      while (!(tid = __atomic_load_n(&pool->workers[t].tid, __ATOMIC_ACQUIRE)))
+        sched_yield();
+
+    for (int c = 0; c < PG_COUNTER_COUNT; c++) {
+      /* Events the calling thread cannot count are skipped everywhere. */
+      int fd = t == 0 || perf->fds[c] >= 0 ? pg__perf_open(c, tid) : -1;
+
+      if (fd < 0 && t == 0)
+        error = errno;
+      opened += t == 0 && fd >= 0;
+      perf->fds[t * PG_COUNTER_COUNT + c] = fd;
+    }
+  }
+
+  if (!opened) {
+    fwprintf(stderr, L"Hardware counters unavailable: %s%s\n", strerror(error),
+             error == EACCES || error == EPERM
+                 ? " (see /proc/sys/kernel/perf_event_paranoid)"
+                 : "");
+    pg__perf_destroy(perf);
+    return NULL;
   }
+
+  pg__perf_read(perf, perf->last);
+
+  return perf;
 }
 
-PGDEF void floyd__steinberg_dither(pgu8 *gray, int width, int height) {
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      int idx = y * width + x;
-      int old_pixel = gray[idx];
-
-      int level = (old_pixel * (ASCII_CHARS_LEN - 1) + 127) / 255;
-      int new_pixel = level * 255 / (ASCII_CHARS_LEN - 1);
-      gray[idx] = (pgu8)new_pixel;
-      float error = old_pixel - new_pixel;
-
-      if (x + 1 < width)
-        gray[y * width + (x + 1)] = (pgu8)fmin(
-            255, fmax(0, gray[y * width + (x + 1)] + error * 7 / 16));
-      if (y + 1 < height) {
-        if (x > 0)
-          gray[y + 1 * width + (x - 1)] = (pgu8)fmin(
-              255, fmax(0, gray[(y + 1) * width + (x - 1)] + error * 3 / 16));
-        gray[(y + 1) * width + x] = (pgu8)fmin(
-            255, fmax(0, gray[(y + 1) * width + x] + error * 5 / 16));
-        if (x + 1 < width)
-          gray[(y + 1) * width + (x + 1)] = (pgu8)fmin(
-              255, fmax(0, gray[(y + 1) * width + (x + 1)] + error * 1 / 16));
-      }
-    }
+/* Adds the events counted since the last read to counts. */
+static void pg__perf_lap(PerfCounters *perf,
+                         long long counts[PG_COUNTER_COUNT]) {
+  long long now[PG_COUNTER_COUNT];
+
+  pg__perf_read(perf, now);
+  for (int c = 0; c < PG_COUNTER_COUNT; c++)
+    counts[c] = now[c] < 0 ? -1 : counts[c] + now[c] - perf->last[c];
+  memcpy(perf->last, now, sizeof(now));
+}
+#else
+static void pg__perf_read(const PerfCounters *perf,
+                          long long counts[PG_COUNTER_COUNT]) {
+  (void)perf;
+  for (int c = 0; c < PG_COUNTER_COUNT; c++)
+    counts[c] = -1;
+}
+
+static void pg__perf_destroy(PerfCounters *perf) { (void)perf; }
+
+static PerfCounters *pg__perf_create(pg_pool *pool) {
+  (void)pool;
+  fwprintf(stderr, L"Hardware counters need Linux perf events.\n");
+  return NULL;
+}
+
+static void pg__perf_lap(PerfCounters *perf,
+                         long long counts[PG_COUNTER_COUNT]) {
+  pg__perf_read(perf, counts);
+}
+#endif
+
+static pg_pool *pg__default_pool(void) {
+  pthread_mutex_lock(&pg__pool_lock);
+  if (!pg__pool) {
+    /* The shared pool outlives the conversion that starts it. */
+    const pg_allocator *previous = pg__use(NULL);
+    pg__pool = pg_pool_create(0);
+    pg__use(previous);
   }
+  pg_pool *pool = pg__pool;
+  pthread_mutex_unlock(&pg__pool_lock);
+
+  return pool;
 }
 
-PGDEF void *process__rows(void *arg) {
-  ThreadData *data = (ThreadData *)arg;
+/* The pool conv was created with or, for NULL, the shared pool as it is now:
+ * pg_init and pg_shutdown replace that one between conversions. */
+static void pg__bind_pool(pg_converter *conv) {
+  conv->pool = conv->user_pool ? conv->user_pool : pg__default_pool();
+  conv->encoder.pool = conv->pool;
+}
 
-  for (int out_y = data->start_row; out_y < data->end_row; out_y++) {
-    int y = out_y * data->vscale;
-    if (y >= data->height)
-      break;
+/* Start of a timed stage: 0 unless stats or tracing are on. */
+static unsigned long long pg__mark(pg_converter *conv) {
+  PerfCounters *perf = conv->perf;
+
+  /* Counters follow the threads that opened them; reopen on a new caller or
+   * once the shared pool has been replaced. */
+  if (perf && (perf->caller != pg__gettid() || !conv->pool ||
+               perf->pool_id != conv->pool->id)) {
+    pg__perf_destroy(perf);
+    perf = conv->perf = conv->pool ? pg__perf_create(conv->pool) : NULL;
+    conv->stats.counters_enabled = perf != NULL;
+  }
+  if (perf)
+    pg__perf_read(perf, perf->last);
+
+  return conv->stats_enabled ? pg__now_ns() : pg__trace_now();
+}
 
-    int buffer_size =
-        data->use_color < 1 ? data->out_cols + 1 : data->out_cols * 24 + 1;
+/* Clears the stats for a new conversion and starts its first stage. */
+static unsigned long long pg__begin(pg_converter *conv) {
+  pg__bind_pool(conv);
 
-    wchar_t *line = (wchar_t *)PG_MALLOC(buffer_size * sizeof(wchar_t));
-    if (!line) {
-      fwprintf(stderr, L"Error allocate memory for line %d\n", out_y);
-      continue;
-    }
+  unsigned long long mark = pg__mark(conv);
 
-    line[0] = L'\0';
-    int pos = 0;
+  memset(&conv->stats, 0, sizeof(pg_stats));
+  conv->allocations = pg__allocations;
+  conv->allocated_bytes = pg__allocated_bytes;
+  if (conv->perf) {
+    conv->stats.counters_enabled = 1;
+    for (int stage = 0; stage < PG_STAGE_COUNT; stage++)
+      for (int c = 0; c < PG_COUNTER_COUNT; c++)
+        conv->stats.counters[stage][c] = conv->perf->last[c] < 0 ? -1 : 0;
+  }
 
-    for (int x = 0; x < data->width; x += data->scale) {
-      int index = y * data->width + x;
-      pgu8 brightness = data->gray[index];
-      int ascii_index = (brightness * (ASCII_CHARS_LEN - 1)) / 255;
-      char c = ASCII_CHARS[ascii_index];
+  return mark;
+}
 
-      if (data->use_color) {
-        int idx_color = (y * data->width + x) * 3;
-        pgu8 r = data->image[idx_color];
-        pgu8 g = data->image[idx_color + 1];
-        pgu8 b = data->image[idx_color + 2];
+/* Ends the stage started at *mark: traces it, adds it to *stage and moves
+ * the mark up. */
+static void pg__lap(const char *name, unsigned long long *stage,
+                    unsigned long long *mark) {
+  if (!*mark)
+    return;
 
-        int n = swprintf(line + pos, buffer_size - pos,
-                         L"\033[38;2;%d;%d;%dm%c\033[0m", r, g, b, c);
+  pg__trace(name, *mark, -1, -1);
 
-        pos += n;
-      } else {
-        line[pos++] = c;
-      }
-    }
+  unsigned long long now = pg__now_ns();
+  *stage += now - *mark;
+  *mark = now;
+}
+
+/* pg__lap into PG_STAGE_* stage of the converter's stats, counters
+ * included. */
+static void pg__stage(pg_converter *conv, const char *name, int stage,
+                      unsigned long long *mark) {
+  pg_stats *stats = &conv->stats;
+  unsigned long long *stages[PG_STAGE_COUNT] = {
+      &stats->decode_ns, &stats->tone_ns,   &stats->gray_ns,
+      &stats->sample_ns, &stats->dither_ns, &stats->render_ns,
+      &stats->write_ns};
+
+  if (*mark && conv->perf)
+    pg__perf_lap(conv->perf, stats->counters[stage]);
+
+  pg__lap(name, stages[stage], mark);
+}
+
+static int pg__reserve(void **buffer, size_t *capacity, size_t size) {
+  if (size <= *capacity)
+    return 0;
+
+  void *grown = PG_MALLOC(size);
+  if (!grown)
+    return -1;
+
+  PG_FREE(*buffer);
+  *buffer = grown;
+  *capacity = size;
 
-    line[pos] = L'\0';
-    data->out[out_y] = line;
+  return 0;
+}
+
+static void pg__scales(const pg_options *opts, int *scale, int *vscale) {
+  *scale = opts->scale < 1 ? 1 : opts->scale;
+  *vscale = (int)(*scale / opts->aspect_ratio);
+  *vscale = *vscale < 1 ? 1 : *vscale;
+}
+
+static size_t pg__line_size(int out_cols, const pg_options *opts,
+                            int background) {
+  size_t cell;
+
+  if (opts->format == PG_FORMAT_HTML) {
+    cell = PG_HTML_GLYPH_MAX;
+    if (opts->use_color)
+      cell += PG_HTML_SPAN_MAX + PG_HTML_CLOSE_LEN +
+              (background ? PG_HTML_SPAN_BG_MAX : 0);
+
+    return out_cols * cell + 1;
   }
 
-  return NULL;
+  cell = PG_GLYPH_MAX;
+
+  if (opts->use_color == PG_COLOR_TRUECOLOR)
+    cell += PG_SGR_MAX * (background ? 2 : 1) + PG_RESET_LEN;
+  else if (opts->use_color == PG_COLOR_256)
+    cell += PG_SGR_256_MAX * (background ? 2 : 1) + PG_RESET_LEN;
+  else if (opts->use_color == PG_COLOR_16)
+    cell += PG_SGR_16_MAX + (background ? PG_SGR_16_BG_MAX : 0) + PG_RESET_LEN;
+
+  return out_cols * cell + 1;
+}
+
+static size_t pg__utf8_encode(char *out, wchar_t c) {
+  pgu32 cp = (pgu32)c;
+
+  if (cp < 0x80) {
+    out[0] = (char)cp;
+    return 1;
+  }
+  if (cp < 0x800) {
+    out[0] = (char)(0xC0 | (cp >> 6));
+    out[1] = (char)(0x80 | (cp & 0x3F));
+    return 2;
+  }
+  if (cp < 0x10000) {
+    out[0] = (char)(0xE0 | (cp >> 12));
+    out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    out[2] = (char)(0x80 | (cp & 0x3F));
+    return 3;
+  }
+
+  out[0] = (char)(0xF0 | (cp >> 18));
+  out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+  out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+  out[3] = (char)(0x80 | (cp & 0x3F));
+  return 4;
+}
+
+/* Fixed-point BT.601 luma; the SIMD kernels below must match it exactly. */
+static void pg__gray_rgb_scalar(const pgu8 *rgb, pgu8 *gray, int count) {
+  for (int i = 0; i < count; i++, rgb += 3)
+    gray[i] = (pgu8)((77 * rgb[0] + 150 * rgb[1] + 29 * rgb[2] + 128) >> 8);
+}
+
+#ifdef PG_X86_SIMD
+/* pshufb masks gathering the R, G and B bytes of 16 interleaved pixels from
+ * each of the three 16-byte loads. */
+static const signed char pg__rgb_shuffle[9][16] = {
+    {0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1},
+    {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13},
+    {1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1},
+    {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14},
+    {2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1},
+    {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15}};
+
+__attribute__((target("ssse3"))) static void
+pg__gray_rgb_ssse3(const pgu8 *rgb, pgu8 *gray, int count) {
+  __m128i mask[9];
+  for (int i = 0; i < 9; i++)
+    mask[i] = _mm_loadu_si128((const __m128i *)pg__rgb_shuffle[i]);
+
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i wr = _mm_set1_epi16(77);
+  const __m128i wg = _mm_set1_epi16(150);
+  const __m128i wb = _mm_set1_epi16(29);
+  const __m128i half = _mm_set1_epi16(128);
+  int i = 0;
+
+  for (; i + 16 <= count; i += 16, rgb += 48) {
+    __m128i a = _mm_loadu_si128((const __m128i *)rgb);
+    __m128i b = _mm_loadu_si128((const __m128i *)(rgb + 16));
+    __m128i c = _mm_loadu_si128((const __m128i *)(rgb + 32));
+
+    __m128i r = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, mask[0]),
+                                          _mm_shuffle_epi8(b, mask[1])),
+                             _mm_shuffle_epi8(c, mask[2]));
+    __m128i g = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, mask[3]),
+                                          _mm_shuffle_epi8(b, mask[4])),
+                             _mm_shuffle_epi8(c, mask[5]));
+    __m128i bl = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, mask[6]),
+                                           _mm_shuffle_epi8(b, mask[7])),
+                              _mm_shuffle_epi8(c, mask[8]));
+
+    __m128i lo = _mm_add_epi16(
+        _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(r, zero), wr),
+                      _mm_mullo_epi16(_mm_unpacklo_epi8(g, zero), wg)),
+        _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(bl, zero), wb), half));
+    __m128i hi = _mm_add_epi16(
+        _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(r, zero), wr),
+                      _mm_mullo_epi16(_mm_unpackhi_epi8(g, zero), wg)),
+        _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(bl, zero), wb), half));
+
+    _mm_storeu_si128((__m128i *)(gray + i),
+                     _mm_packus_epi16(_mm_srli_epi16(lo, 8),
+                                      _mm_srli_epi16(hi, 8)));
+  }
+
+  pg__gray_rgb_scalar(rgb, gray + i, count - i);
+}
+
+/* Each 128-bit lane handles its own 16 pixels, so the SSSE3 masks apply
+ * unchanged and the lane-wise pack keeps pixels in order. */
+__attribute__((target("avx2"))) static void
+pg__gray_rgb_avx2(const pgu8 *rgb, pgu8 *gray, int count) {
+  __m256i mask[9];
+  for (int i = 0; i < 9; i++)
+    mask[i] = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)pg__rgb_shuffle[i]));
+
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i wr = _mm256_set1_epi16(77);
+  const __m256i wg = _mm256_set1_epi16(150);
+  const __m256i wb = _mm256_set1_epi16(29);
+  const __m256i half = _mm256_set1_epi16(128);
+  int i = 0;
+
+  for (; i + 32 <= count; i += 32, rgb += 96) {
+    __m256i v[3];
+    for (int k = 0; k < 3; k++)
+      v[k] = _mm256_inserti128_si256(
+          _mm256_castsi128_si256(
+              _mm_loadu_si128((const __m128i *)(rgb + 16 * k))),
+          _mm_loadu_si128((const __m128i *)(rgb + 48 + 16 * k)), 1);
+
+    __m256i c[3];
+    for (int k = 0; k < 3; k++)
+      c[k] = _mm256_or_si256(
+          _mm256_or_si256(_mm256_shuffle_epi8(v[0], mask[3 * k]),
+                          _mm256_shuffle_epi8(v[1], mask[3 * k + 1])),
+          _mm256_shuffle_epi8(v[2], mask[3 * k + 2]));
+
+    __m256i lo = _mm256_add_epi16(
+        _mm256_add_epi16(
+            _mm256_mullo_epi16(_mm256_unpacklo_epi8(c[0], zero), wr),
+            _mm256_mullo_epi16(_mm256_unpacklo_epi8(c[1], zero), wg)),
+        _mm256_add_epi16(
+            _mm256_mullo_epi16(_mm256_unpacklo_epi8(c[2], zero), wb), half));
+    __m256i hi = _mm256_add_epi16(
+        _mm256_add_epi16(
+            _mm256_mullo_epi16(_mm256_unpackhi_epi8(c[0], zero), wr),
+            _mm256_mullo_epi16(_mm256_unpackhi_epi8(c[1], zero), wg)),
+        _mm256_add_epi16(
+            _mm256_mullo_epi16(_mm256_unpackhi_epi8(c[2], zero), wb), half));
+
+    _mm256_storeu_si256((__m256i *)(gray + i),
+                        _mm256_packus_epi16(_mm256_srli_epi16(lo, 8),
+                                            _mm256_srli_epi16(hi, 8)));
+  }
+
+  pg__gray_rgb_scalar(rgb, gray + i, count - i);
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void
+pg__gray_rgb_avx512(const pgu8 *rgb, pgu8 *gray, int count) {
+  __m512i mask[9];
+  for (int i = 0; i < 9; i++)
+    mask[i] = _mm512_broadcast_i32x4(
+        _mm_loadu_si128((const __m128i *)pg__rgb_shuffle[i]));
+
+  const __m512i zero = _mm512_setzero_si512();
+  const __m512i wr = _mm512_set1_epi16(77);
+  const __m512i wg = _mm512_set1_epi16(150);
+  const __m512i wb = _mm512_set1_epi16(29);
+  const __m512i half = _mm512_set1_epi16(128);
+  int i = 0;
+
+  for (; i + 64 <= count; i += 64, rgb += 192) {
+    __m512i v[3];
+    for (int k = 0; k < 3; k++) {
+      v[k] = _mm512_castsi128_si512(
+          _mm_loadu_si128((const __m128i *)(rgb + 16 * k)));
+      v[k] = _mm512_inserti32x4(
+          v[k], _mm_loadu_si128((const __m128i *)(rgb + 48 + 16 * k)), 1);
+      v[k] = _mm512_inserti32x4(
+          v[k], _mm_loadu_si128((const __m128i *)(rgb + 96 + 16 * k)), 2);
+      v[k] = _mm512_inserti32x4(
+          v[k], _mm_loadu_si128((const __m128i *)(rgb + 144 + 16 * k)), 3);
+    }
+
+    __m512i c[3];
+    for (int k = 0; k < 3; k++)
+      c[k] = _mm512_or_si512(
+          _mm512_or_si512(_mm512_shuffle_epi8(v[0], mask[3 * k]),
+                          _mm512_shuffle_epi8(v[1], mask[3 * k + 1])),
+          _mm512_shuffle_epi8(v[2], mask[3 * k + 2]));
+
+    __m512i lo = _mm512_add_epi16(
+        _mm512_add_epi16(
+            _mm512_mullo_epi16(_mm512_unpacklo_epi8(c[0], zero), wr),
+            _mm512_mullo_epi16(_mm512_unpacklo_epi8(c[1], zero), wg)),
+        _mm512_add_epi16(
+            _mm512_mullo_epi16(_mm512_unpacklo_epi8(c[2], zero), wb), half));
+    __m512i hi = _mm512_add_epi16(
+        _mm512_add_epi16(
+            _mm512_mullo_epi16(_mm512_unpackhi_epi8(c[0], zero), wr),
+            _mm512_mullo_epi16(_mm512_unpackhi_epi8(c[1], zero), wg)),
+        _mm512_add_epi16(
+            _mm512_mullo_epi16(_mm512_unpackhi_epi8(c[2], zero), wb), half));
+
+    _mm512_storeu_si512((void *)(gray + i),
+                        _mm512_packus_epi16(_mm512_srli_epi16(lo, 8),
+                                            _mm512_srli_epi16(hi, 8)));
+  }
+
+  pg__gray_rgb_scalar(rgb, gray + i, count - i);
+}
+#endif // PG_X86_SIMD
+
+static pg_gray_kernel pg__select_gray_kernel(void) {
+#ifdef PG_X86_SIMD
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx512bw"))
+    return pg__gray_rgb_avx512;
+  if (__builtin_cpu_supports("avx2"))
+    return pg__gray_rgb_avx2;
+  if (__builtin_cpu_supports("ssse3"))
+    return pg__gray_rgb_ssse3;
+#endif // PG_X86_SIMD
+
+  return pg__gray_rgb_scalar;
+}
+
+/* Multi-level ordered dithering: with t = v * (levels - 1), the level is
+ * t / 255 bumped by one where the remainder plus the threshold reaches 255.
+ * The SSE2 path computes t / 255 as (t + 1 + (t >> 8)) >> 8 and the level
+ * back to gray with a reciprocal multiply; pg__ordered_simd_exact checks
+ * both are exact for ASCII_CHARS_LEN. */
+static pgu32 pg__level_magic(void) {
+  return (65536 + ASCII_CHARS_LEN - 2) / (ASCII_CHARS_LEN - 1);
+}
+
+static int pg__ordered_simd_exact(void) {
+  pgu32 magic = pg__level_magic();
+
+  if (magic > 65535)
+    return 0;
+  for (pgu32 t = 0; t <= 255 * (ASCII_CHARS_LEN - 1); t++)
+    if ((t + 1 + (t >> 8)) >> 8 != t / 255)
+      return 0;
+  for (pgu32 level = 0; level < ASCII_CHARS_LEN; level++)
+    if ((level * 255 * magic) >> 16 != level * 255 / (ASCII_CHARS_LEN - 1))
+      return 0;
+
+  return 1;
+}
+
+/* pg__dec[v] holds the decimal digits of v with their count in the last
+ * byte, so an escape writer can always copy 4 bytes and advance by [3]. The
+ * same layout is used for the UTF-8 glyphs. */
+static void pg__init_tables(void) {
+  for (int i = 0; i < 256; i++)
+    pg__dec[i][3] = (char)snprintf(pg__dec[i], 4, "%d", i);
+
+  for (size_t i = 0; i < ASCII_CHARS_LEN; i++) {
+    const char *entity = ASCII_CHARS[i] == L'&'   ? "&amp;"
+                         : ASCII_CHARS[i] == L'<' ? "&lt;"
+                         : ASCII_CHARS[i] == L'>' ? "&gt;"
+                                                  : NULL;
+
+    pg__glyphs[i][PG_GLYPH_MAX] =
+        (char)pg__utf8_encode(pg__glyphs[i], ASCII_CHARS[i]);
+
+    if (entity) {
+      pg__html_glyphs[i][PG_HTML_GLYPH_MAX] = (char)strlen(entity);
+      memcpy(pg__html_glyphs[i], entity, strlen(entity));
+    } else {
+      pg__html_glyphs[i][PG_HTML_GLYPH_MAX] = pg__glyphs[i][PG_GLYPH_MAX];
+      memcpy(pg__html_glyphs[i], pg__glyphs[i], PG_GLYPH_MAX);
+    }
+  }
+
+  for (int i = 0; i < 256; i++)
+    pg__glyph_index[i] = (pgu8)(i * (ASCII_CHARS_LEN - 1) / 255);
+
+  pg__gray_rgb = pg__select_gray_kernel();
+
+  for (int y = 0; y < 8; y++) {
+    for (int x = 0; x < 32; x++) {
+      int rank = 0;
+      for (int bit = 0; bit < 3; bit++) {
+        int bx = x >> bit & 1, by = y >> bit & 1;
+        rank |= ((bx ^ by) << 1 | by) << (2 * (2 - bit));
+      }
+
+      pg__bayer8[y][x] = (pgu8)((2 * rank + 1) * 255 / 128);
+      if (y < 4)
+        pg__bayer4[y][x] = (pgu8)((2 * (rank >> 2) + 1) * 255 / 32);
+    }
+  }
+
+  pg__ordered_simd = pg__ordered_simd_exact();
+  pg__cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+static char *pg__write_glyph(char *out, int index) {
+  memcpy(out, pg__glyphs[index], PG_GLYPH_MAX);
+  return out + pg__glyphs[index][PG_GLYPH_MAX];
+}
+
+static char *pg__write_dec(char *out, pgu8 value) {
+  memcpy(out, pg__dec[value], 4);
+  return out + pg__dec[value][3];
+}
+
+static char *pg__write_truecolor(char *out, const pgu8 rgb[3],
+                                 int background) {
+  memcpy(out, background ? "\033[48;2;" : "\033[38;2;", 7);
+  out = pg__write_dec(out + 7, rgb[0]);
+  *out++ = ';';
+  out = pg__write_dec(out, rgb[1]);
+  *out++ = ';';
+  out = pg__write_dec(out, rgb[2]);
+  *out++ = 'm';
+
+  return out;
+}
+
+static char *pg__write_palette(char *out, int use_color, pgu8 index,
+                               int background) {
+  if (use_color == PG_COLOR_16) {
+    memcpy(out, "\033[", 2);
+    out += 2;
+    if (background && index >= 8) {
+      memcpy(out, "10", 2);
+      out += 2;
+    } else {
+      *out++ = background ? '4' : (index < 8 ? '3' : '9');
+    }
+    *out++ = (char)('0' + (index & 7));
+    *out++ = 'm';
+
+    return out;
+  }
+
+  memcpy(out, background ? "\033[48;5;" : "\033[38;5;", 7);
+  out = pg__write_dec(out + 7, index);
+  *out++ = 'm';
+
+  return out;
+}
+
+static char *pg__write_html_glyph(char *out, int index) {
+  memcpy(out, pg__html_glyphs[index], PG_HTML_GLYPH_MAX);
+  return out + pg__html_glyphs[index][PG_HTML_GLYPH_MAX];
+}
+
+static char *pg__write_hex(char *out, const pgu8 rgb[3]) {
+  static const char digits[] = "0123456789abcdef";
+
+  *out++ = '#';
+  for (int i = 0; i < 3; i++) {
+    *out++ = digits[rgb[i] >> 4];
+    *out++ = digits[rgb[i] & 15];
+  }
+
+  return out;
+}
+
+static void pg__palette_color(int index, pgu8 rgb[3]) {
+  static const pgu8 system[16][3] = {
+      {0, 0, 0},       {205, 0, 0},     {0, 205, 0},     {205, 205, 0},
+      {0, 0, 238},     {205, 0, 205},   {0, 205, 205},   {229, 229, 229},
+      {127, 127, 127}, {255, 0, 0},     {0, 255, 0},     {255, 255, 0},
+      {92, 92, 255},   {255, 0, 255},   {0, 255, 255},   {255, 255, 255}};
+  static const pgu8 levels[6] = {0, 95, 135, 175, 215, 255};
+
+  if (index < 16) {
+    memcpy(rgb, system[index], 3);
+  } else if (index < 232) {
+    rgb[0] = levels[(index - 16) / 36];
+    rgb[1] = levels[(index - 16) / 6 % 6];
+    rgb[2] = levels[(index - 16) % 6];
+  } else {
+    rgb[0] = rgb[1] = rgb[2] = (pgu8)(8 + (index - 232) * 10);
+  }
+}
+
+static float pg__srgb_to_linear(float c) {
+  return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+static void pg__oklab(const pgu8 rgb[3], float lab[3]) {
+  float r = pg__srgb_to_linear(rgb[0] / 255.0f);
+  float g = pg__srgb_to_linear(rgb[1] / 255.0f);
+  float b = pg__srgb_to_linear(rgb[2] / 255.0f);
+
+  float l = cbrtf(0.4122214708f * r + 0.5363325363f * g + 0.0514459929f * b);
+  float m = cbrtf(0.2119034982f * r + 0.6806995451f * g + 0.1073969566f * b);
+  float s = cbrtf(0.0883024619f * r + 0.2817188376f * g + 0.6299787005f * b);
+
+  lab[0] = 0.2104542553f * l + 0.7936177850f * m - 0.0040720468f * s;
+  lab[1] = 1.9779984951f * l - 2.4285922050f * m + 0.4505937099f * s;
+  lab[2] = 0.0259040371f * l + 0.7827717662f * m - 0.8086757660f * s;
+}
+
+/* The 16 system colors differ between terminals, so 256-color output only
+ * picks from the 6x6x6 cube and the gray ramp. */
+static void pg__build_palette(pgu8 *table, int first, int count) {
+  float palette[256][3];
+
+  for (int i = 0; i < count; i++) {
+    pgu8 rgb[3];
+    pg__palette_color(first + i, rgb);
+    pg__oklab(rgb, palette[i]);
+  }
+
+  for (int i = 0; i < 32 * 32 * 32; i++) {
+    pgu8 rgb[3] = {(pgu8)((i >> 10) * 8 + 4), (pgu8)((i >> 5 & 31) * 8 + 4),
+                   (pgu8)((i & 31) * 8 + 4)};
+    float lab[3];
+    pg__oklab(rgb, lab);
+
+    int best = 0;
+    float best_distance = 1e30f;
+
+    for (int j = 0; j < count; j++) {
+      float dl = lab[0] - palette[j][0];
+      float da = lab[1] - palette[j][1];
+      float db = lab[2] - palette[j][2];
+      float distance = dl * dl + da * da + db * db;
+
+      if (distance < best_distance) {
+        best_distance = distance;
+        best = j;
+      }
+    }
+
+    table[i] = (pgu8)(first + best);
+  }
+}
+
+static void pg__init_palette_256(void) {
+  pg__build_palette(pg__palette_256, 16, 240);
+}
+
+static void pg__init_palette_16(void) {
+  pg__build_palette(pg__palette_16, 0, 16);
+}
+
+/* With identity levels, gamma and brightness this reproduces
+ * apply__contrast exactly. */
+static void pg__build_tone(const pg_options *opts, pgu8 tone[256]) {
+  int black = opts->black_level;
+  int white = opts->white_level > black ? opts->white_level : black + 1;
+
+  for (int i = 0; i < 256; i++) {
+    float val = (float)i;
+
+    if (black != 0 || white != 255) {
+      val = (val - black) * 255.0f / (white - black);
+      val = val < 0 ? 0 : (val > 255 ? 255 : val);
+    }
+    if (opts->gamma > 0 && opts->gamma != 1.0f)
+      val = 255.0f * powf(val / 255.0f, 1.0f / opts->gamma);
+
+    val = (val - 128.0f) * opts->contrast + 128.0f;
+    if (opts->brightness != 0)
+      val += opts->brightness;
+
+    if (val < 0)
+      val = 0;
+    if (val > 255)
+      val = 255;
+    tone[i] = (pgu8)val;
+  }
+}
+
+static void pg__ordered_row(pgu8 *row, int width, int y,
+                            const OrderedMap *map) {
+  const pgu8 *thresholds = map->rows + (y & map->mask) * 32;
+  int x = 0;
+
+#ifdef PG_SSE2
+  if (pg__ordered_simd) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i levels = _mm_set1_epi16(ASCII_CHARS_LEN - 1);
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i full = _mm_set1_epi16(255);
+    const __m128i top = _mm_set1_epi16(254);
+    const __m128i magic = _mm_set1_epi16((short)pg__level_magic());
+
+    for (; x + 16 <= width; x += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(row + x));
+      __m128i thr = _mm_loadu_si128((const __m128i *)(thresholds + (x & 31)));
+      __m128i half[2];
+
+      for (int k = 0; k < 2; k++) {
+        __m128i t = _mm_mullo_epi16(k ? _mm_unpackhi_epi8(v, zero)
+                                      : _mm_unpacklo_epi8(v, zero),
+                                    levels);
+        __m128i th = k ? _mm_unpackhi_epi8(thr, zero)
+                       : _mm_unpacklo_epi8(thr, zero);
+        __m128i base = _mm_srli_epi16(
+            _mm_add_epi16(_mm_add_epi16(t, one), _mm_srli_epi16(t, 8)), 8);
+        __m128i rem = _mm_sub_epi16(t, _mm_mullo_epi16(base, full));
+        __m128i bump = _mm_cmpgt_epi16(_mm_add_epi16(rem, th), top);
+        __m128i level = _mm_sub_epi16(base, bump);
+
+        half[k] = _mm_mulhi_epu16(_mm_mullo_epi16(level, full), magic);
+      }
+
+      _mm_storeu_si128((__m128i *)(row + x), _mm_packus_epi16(half[0], half[1]));
+    }
+  }
+#endif // PG_SSE2
+
+  for (; x < width; x++) {
+    int t = row[x] * (ASCII_CHARS_LEN - 1);
+    int level = t / 255;
+
+    level += t - level * 255 + thresholds[x & 31] > 254;
+    row[x] = (pgu8)(level * 255 / (ASCII_CHARS_LEN - 1));
+  }
+}
+
+/* Void-and-cluster (Ulichney) on a 32x32 torus with a Gaussian filter,
+ * seeded deterministically so the texture is the same in every process. */
+static void pg__init_blue_noise(void) {
+  enum { SIZE = 32, N = SIZE * SIZE, INITIAL = N / 10 };
+  static float filter[SIZE][SIZE];
+  static float energy[N];
+  static pgu8 pattern[N], initial[N];
+  static int rank[N];
+
+  for (int dy = 0; dy < SIZE; dy++) {
+    for (int dx = 0; dx < SIZE; dx++) {
+      int ty = dy < SIZE / 2 ? dy : SIZE - dy;
+      int tx = dx < SIZE / 2 ? dx : SIZE - dx;
+      filter[dy][dx] = expf(-(float)(tx * tx + ty * ty) / (2 * 1.5f * 1.5f));
+    }
+  }
+
+#define PG__TOGGLE(p, sign)                                                    \
+  for (int q = 0; q < N; q++)                                                  \
+    energy[q] += (sign) * filter[((q / SIZE) - (p) / SIZE + SIZE) % SIZE]      \
+                                [((q % SIZE) - (p) % SIZE + SIZE) % SIZE];
+#define PG__EXTREME(result, value, best_cmp)                                   \
+  do {                                                                         \
+    result = -1;                                                               \
+    for (int q = 0; q < N; q++)                                                \
+      if (pattern[q] == (value) &&                                             \
+          (result < 0 || energy[q] best_cmp energy[result]))                   \
+        result = q;                                                            \
+  } while (0)
+
+  pgu32 seed = 0x9E3779B9u;
+  memset(pattern, 0, sizeof(pattern));
+  memset(energy, 0, sizeof(energy));
+
+  for (int placed = 0; placed < INITIAL;) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+
+    int p = (int)(seed % N);
+    if (!pattern[p]) {
+      pattern[p] = 1;
+      PG__TOGGLE(p, 1.0f);
+      placed++;
+    }
+  }
+
+  for (;;) {
+    int cluster, void_;
+
+    PG__EXTREME(cluster, 1, >);
+    pattern[cluster] = 0;
+    PG__TOGGLE(cluster, -1.0f);
+
+    PG__EXTREME(void_, 0, <);
+    pattern[void_] = 1;
+    PG__TOGGLE(void_, 1.0f);
+
+    if (void_ == cluster)
+      break;
+  }
+
+  memcpy(initial, pattern, sizeof(pattern));
+  float initial_energy[N];
+  memcpy(initial_energy, energy, sizeof(energy));
+
+  for (int r = INITIAL - 1; r >= 0; r--) {
+    int cluster;
+
+    PG__EXTREME(cluster, 1, >);
+    pattern[cluster] = 0;
+    PG__TOGGLE(cluster, -1.0f);
+    rank[cluster] = r;
+  }
+
+  memcpy(pattern, initial, sizeof(pattern));
+  memcpy(energy, initial_energy, sizeof(energy));
+
+  for (int r = INITIAL; r < N; r++) {
+    int void_;
+
+    PG__EXTREME(void_, 0, <);
+    pattern[void_] = 1;
+    PG__TOGGLE(void_, 1.0f);
+    rank[void_] = r;
+  }
+
+#undef PG__EXTREME
+#undef PG__TOGGLE
+
+  for (int i = 0; i < N; i++)
+    pg__blue_noise[i / SIZE][i % SIZE] = (pgu8)((2 * rank[i] + 1) * 255 / (2 * N));
+}
+
+static int pg__ordered_map(int dither, OrderedMap *map) {
+  if (dither == PG_DITHER_BAYER4) {
+    map->rows = pg__bayer4[0];
+    map->mask = 3;
+  } else if (dither == PG_DITHER_BAYER8) {
+    map->rows = pg__bayer8[0];
+    map->mask = 7;
+  } else if (dither == PG_DITHER_BLUE_NOISE) {
+    pthread_once(&pg__blue_noise_once, pg__init_blue_noise);
+    map->rows = pg__blue_noise[0];
+    map->mask = 31;
+  } else {
+    return 0;
+  }
+
+  return 1;
+}
+
+/* Luma and tone mapping in one pass: each row is tone mapped while it is
+ * still in L1, so the gray plane is written once and never re-read. */
+static void pg__gray_task(void *arg, int thread_index, int num_threads) {
+  (void)thread_index;
+  GrayData *data = (GrayData *)arg;
+  const struct Image *image = data->image;
+  const pgu8 *tone = data->tone;
+  int chunk = pg__chunk(image->height, num_threads);
+  int begin, end;
+  ChunkTrace trace = {"gray", 0};
+
+  while (pg__claim(&data->next_row, image->height, chunk, &begin, &end,
+                   &trace)) {
+    for (int y = begin; y < end; y++) {
+      const pgu8 *src = image->data + (size_t)y * image->stride;
+      pgu8 *dst = data->gray + (size_t)y * image->width;
+
+      if (image->channels == 3) {
+        pg__gray_rgb(src, dst, image->width);
+
+        for (int x = 0; x < image->width; x++)
+          dst[x] = tone[dst[x]];
+      } else if (image->channels == 4) {
+        for (int x = 0; x < image->width; x++, src += 4)
+          dst[x] =
+              tone[(77 * src[0] + 150 * src[1] + 29 * src[2] + 128) >> 8];
+      } else {
+        for (int x = 0; x < image->width; x++, src += image->channels)
+          dst[x] = tone[src[0]];
+      }
+
+      if (data->ordered)
+        pg__ordered_row(dst, image->width, y, data->ordered);
+    }
+  }
+}
+
+/* sums[i] += row[i] * weight, weight <= 257 so products fit 16 bits. */
+static void pg__accumulate(pgu32 *sums, const pgu8 *row, int count,
+                           pgu32 weight) {
+  int i = 0;
+
+#ifdef PG_SSE2
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i w = _mm_set1_epi16((short)weight);
+
+  for (; weight <= 257 && i + 16 <= count; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(row + i));
+    __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), w);
+    __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), w);
+    __m128i *out = (__m128i *)(sums + i);
+
+    _mm_storeu_si128(out, _mm_add_epi32(_mm_loadu_si128(out),
+                                        _mm_unpacklo_epi16(lo, zero)));
+    _mm_storeu_si128(out + 1, _mm_add_epi32(_mm_loadu_si128(out + 1),
+                                            _mm_unpackhi_epi16(lo, zero)));
+    _mm_storeu_si128(out + 2, _mm_add_epi32(_mm_loadu_si128(out + 2),
+                                            _mm_unpacklo_epi16(hi, zero)));
+    _mm_storeu_si128(out + 3, _mm_add_epi32(_mm_loadu_si128(out + 3),
+                                            _mm_unpackhi_epi16(hi, zero)));
+  }
+#endif // PG_SSE2
+
+  for (; i < count; i++)
+    sums[i] += row[i] * weight;
+}
+
+static pgu32 pg__tent(int i, int size, int sampling) {
+  if (sampling != PG_SAMPLE_WEIGHTED)
+    return 1;
+
+  return (pgu32)(i + 1 < size - i ? i + 1 : size - i);
+}
+
+/* Box and weighted sampling: the cell's rows are summed column-wise with
+ * the vectorized accumulator, then each cell reduces its own columns. */
+static void pg__sample_area(SampleData *data, int thread_index, int out_y) {
+  const struct Image *image = data->image;
+  int width = image->width;
+  int channels = image->channels;
+  pgu32 *sums = data->sums + (size_t)thread_index * width * (channels + 1);
+  pgu32 *gray_sums = sums + (size_t)width * channels;
+
+  int y0 = out_y * data->vscale;
+  int y1 = y0 + data->vscale < image->height ? y0 + data->vscale
+                                             : image->height;
+  pgu32 total_y = 0;
+
+  memset(sums, 0, (size_t)width * (channels + 1) * sizeof(pgu32));
+
+  for (int y = y0; y < y1; y++) {
+    pgu32 weight = pg__tent(y - y0, y1 - y0, data->sampling);
+
+    pg__accumulate(sums, image->data + (size_t)y * image->stride,
+                   width * channels, weight);
+    if (data->gray)
+      pg__accumulate(gray_sums, data->gray + (size_t)y * width, width, weight);
+
+    total_y += weight;
+  }
+
+  pgu8 *cells = data->cells + (size_t)out_y * data->out_cols;
+  pgu8 *colors = data->colors + (size_t)out_y * data->out_cols * 3;
+
+  for (int out_x = 0; out_x < data->out_cols; out_x++, colors += 3) {
+    int x0 = out_x * data->scale;
+    int x1 = x0 + data->scale < width ? x0 + data->scale : width;
+    unsigned long long sum[4] = {0, 0, 0, 0}, gray_sum = 0, total = 0;
+
+    for (int x = x0; x < x1; x++) {
+      pgu32 weight = pg__tent(x - x0, x1 - x0, data->sampling);
+
+      for (int c = 0; c < channels; c++)
+        sum[c] += (unsigned long long)sums[x * channels + c] * weight;
+      gray_sum += (unsigned long long)gray_sums[x] * weight;
+      total += weight;
+    }
+
+    total *= total_y;
+    for (int c = 0; c < channels; c++)
+      sum[c] = (sum[c] + total / 2) / total;
+
+    colors[0] = (pgu8)sum[0];
+    colors[1] = (pgu8)sum[channels < 3 ? 0 : 1];
+    colors[2] = (pgu8)sum[channels < 3 ? 0 : 2];
+
+    if (data->gray)
+      cells[out_x] = (pgu8)((gray_sum + total / 2) / total);
+    else
+      cells[out_x] = data->tone[(77 * colors[0] + 150 * colors[1] +
+                                 29 * colors[2] + 128) >>
+                                8];
+  }
+}
+
+static void pg__glyph_row(pgu8 *cells, int count) {
+  for (int x = 0; x < count; x++)
+    cells[x] = pg__glyph_index[cells[x]];
+}
+
+static void pg__sample_point(SampleData *data, int out_y) {
+  const struct Image *image = data->image;
+  int channels = image->channels;
+  int y = out_y * data->vscale;
+  const pgu8 *row = image->data + (size_t)y * image->stride;
+  pgu8 *cells = data->cells + (size_t)out_y * data->out_cols;
+  pgu8 *colors = data->colors + (size_t)out_y * data->out_cols * 3;
+
+  for (int out_x = 0; out_x < data->out_cols; out_x++, colors += 3) {
+    int x = out_x * data->scale;
+    const pgu8 *pixel = row + x * channels;
+
+    colors[0] = pixel[0];
+    colors[1] = pixel[channels < 3 ? 0 : 1];
+    colors[2] = pixel[channels < 3 ? 0 : 2];
+
+    if (data->gray)
+      cells[out_x] = data->gray[(size_t)y * image->width + x];
+    else if (channels < 3)
+      cells[out_x] = data->tone[pixel[0]];
+    else
+      cells[out_x] = data->tone[(77 * colors[0] + 150 * colors[1] +
+                                 29 * colors[2] + 128) >>
+                                8];
+  }
+}
+
+static void pg__sample_task(void *arg, int thread_index, int num_threads) {
+  SampleData *data = (SampleData *)arg;
+  int chunk = pg__chunk(data->out_rows, num_threads);
+  int begin, end;
+  ChunkTrace trace = {"sample", 0};
+
+  while (pg__claim(&data->next_row, data->out_rows, chunk, &begin, &end,
+                   &trace)) {
+    for (int out_y = begin; out_y < end; out_y++) {
+      if (data->sampling != PG_SAMPLE_POINT)
+        pg__sample_area(data, thread_index, out_y);
+      else
+        pg__sample_point(data, out_y);
+
+      if (data->ordered)
+        pg__ordered_row(data->cells + (size_t)out_y * data->out_cols,
+                        data->out_cols, out_y, data->ordered);
+      if (data->glyphs)
+        pg__glyph_row(data->cells + (size_t)out_y * data->out_cols,
+                      data->out_cols);
+    }
+  }
+}
+
+/* For cells that are error diffused after sampling. */
+static void pg__glyph_task(void *arg, int thread_index, int num_threads) {
+  (void)thread_index;
+  SampleData *data = (SampleData *)arg;
+  int chunk = pg__chunk(data->out_rows, num_threads);
+  int begin, end;
+  ChunkTrace trace = {"glyphs", 0};
+
+  while (pg__claim(&data->next_row, data->out_rows, chunk, &begin, &end,
+                   &trace)) {
+    for (int out_y = begin; out_y < end; out_y++)
+      pg__glyph_row(data->cells + (size_t)out_y * data->out_cols,
+                    data->out_cols);
+  }
+}
+
+static void pg__spin(unsigned *spins) {
+  if (++*spins < 64) {
+#ifdef PG_X86_SIMD
+    _mm_pause();
+#endif // PG_X86_SIMD
+  } else {
+    sched_yield();
+  }
+}
+
+static void pg__fs_pixel(pgu8 *gray, int width, int height, int x, int y) {
+  int idx = y * width + x;
+  int old_pixel = gray[idx];
+
+  int level = (old_pixel * (ASCII_CHARS_LEN - 1) + 127) / 255;
+  int new_pixel = level * 255 / (ASCII_CHARS_LEN - 1);
+  gray[idx] = (pgu8)new_pixel;
+  float error = old_pixel - new_pixel;
+
+  if (x + 1 < width)
+    gray[y * width + (x + 1)] = (pgu8)fmin(
+        255, fmax(0, gray[y * width + (x + 1)] + error * 7 / 16));
+  if (y + 1 < height) {
+    if (x > 0)
+      gray[(y + 1) * width + (x - 1)] = (pgu8)fmin(
+          255, fmax(0, gray[(y + 1) * width + (x - 1)] + error * 3 / 16));
+    gray[(y + 1) * width + x] =
+        (pgu8)fmin(255, fmax(0, gray[(y + 1) * width + x] + error * 5 / 16));
+    if (x + 1 < width)
+      gray[(y + 1) * width + (x + 1)] = (pgu8)fmin(
+          255, fmax(0, gray[(y + 1) * width + (x + 1)] + error * 1 / 16));
+  }
+}
+
+/* Rows are claimed one at a time and in increasing order, so the row a
+ * thread waits on always belongs to a thread that is already running it.
+ * Pixel x of row y may only be processed once row y - 1 has finished x + 2:
+ * that is the last pixel diffusing into (x + 1, y), which this pixel's own
+ * error is added to. Every pixel then sees the same sequence of updates as
+ * in the serial scan, so the result is bit-identical. */
+static void pg__dither_task(void *arg, int thread_index, int num_threads) {
+  (void)thread_index;
+  (void)num_threads;
+  DitherData *data = (DitherData *)arg;
+  int width = data->width;
+  int y, end;
+  ChunkTrace trace = {"dither", 0};
+
+  while (pg__claim(&data->next_row, data->height, 1, &y, &end, &trace)) {
+    int *above = y > 0 ? data->progress + (y - 1) * PG_PROGRESS_STRIDE : NULL;
+    int *done = data->progress + y * PG_PROGRESS_STRIDE;
+    int limit = y > 0 ? 0 : width;
+
+    for (int x = 0; x < width; x++) {
+      unsigned spins = 0;
+
+      while (x >= limit) {
+        int ready = __atomic_load_n(above, __ATOMIC_ACQUIRE);
+
+        limit = ready == width ? width : ready - 2;
+        if (x >= limit)
+          pg__spin(&spins);
+      }
+
+      pg__fs_pixel(data->gray, width, data->height, x, y);
+
+      if ((x & 15) == 15)
+        __atomic_store_n(done, x + 1, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(done, width, __ATOMIC_RELEASE);
+  }
+}
+
+static unsigned long long pg__dither(pg_pool *pool, int threads, pgu8 *gray,
+                                     int width, int height, int *progress) {
+  if (threads <= 1 || height < 2) {
+    unsigned long long start = pg__now_ns();
+
+    floyd__steinberg_dither(gray, width, height);
+    return pg__now_ns() - start;
+  }
+
+  memset(progress, 0, (size_t)height * PG_PROGRESS_STRIDE * sizeof(int));
+
+  DitherData dither_data = {gray, width, height, progress, 0};
+  return pg__pool_run_n(pool, threads, pg__dither_task, &dither_data);
+}
+
+/* Integer error diffusion. A quantization error is at most 6, so even
+ * Jarvis' weighted sums (<= 48 * 6) fit 16 bits; they are kept as
+ * numerators over the kernel divisor in three rolling rows padded by two on
+ * each side. Rounding the numerator, clamping and quantizing are all table
+ * lookups. */
+static inline void pg__diffuse_kernel(pgu8 *gray, int width, int height,
+                                      const DitherKernel *kernel,
+                                      short *errors) {
+  short adjust[1024];
+  pgu8 quantized[320];
+  signed char residual[320];
+  int stride = width + 4;
+  int divisor = kernel->divisor;
+
+  for (int i = 0; i < 1024; i++) {
+    int acc = i - 512;
+    adjust[i] = (short)((acc >= 0 ? acc + divisor / 2 : acc - divisor / 2) /
+                        divisor);
+  }
+
+  for (int i = 0; i < 320; i++) {
+    int old_pixel = i - 32 < 0 ? 0 : (i - 32 > 255 ? 255 : i - 32);
+    int level = (old_pixel * (ASCII_CHARS_LEN - 1) + 127) / 255;
+    int new_pixel = level * 255 / (ASCII_CHARS_LEN - 1);
+
+    quantized[i] = (pgu8)new_pixel;
+    residual[i] = (signed char)(old_pixel - new_pixel);
+  }
+
+  memset(errors, 0, (size_t)3 * stride * sizeof(short));
+
+  for (int y = 0; y < height; y++) {
+    short *rows[3];
+    for (int i = 0; i < 3; i++)
+      rows[i] = errors + (size_t)((y + i) % 3) * stride + 2;
+
+    pgu8 *line = gray + (size_t)y * width;
+
+    for (int x = 0; x < width; x++) {
+      int value = line[x] + adjust[rows[0][x] + 512] + 32;
+      int error = residual[value];
+
+      line[x] = quantized[value];
+
+      for (int i = 0; i < kernel->count; i++) {
+        const DitherTap *tap = &kernel->taps[i];
+        rows[tap->dy][x + tap->dx] += (short)(error * tap->weight);
+      }
+    }
+
+    memset(rows[0] - 2, 0, stride * sizeof(short));
+  }
+}
+
+/* Dispatching on constant kernels lets the compiler unroll the taps. */
+static void pg__diffuse(pgu8 *gray, int width, int height, int dither,
+                        short *errors) {
+  switch (dither) {
+  case PG_DITHER_FS_INTEGER:
+    pg__diffuse_kernel(gray, width, height, &pg__kernels[0], errors);
+    break;
+  case PG_DITHER_ATKINSON:
+    pg__diffuse_kernel(gray, width, height, &pg__kernels[1], errors);
+    break;
+  case PG_DITHER_SIERRA_LITE:
+    pg__diffuse_kernel(gray, width, height, &pg__kernels[2], errors);
+    break;
+  case PG_DITHER_JARVIS:
+    pg__diffuse_kernel(gray, width, height, &pg__kernels[3], errors);
+    break;
+  }
+}
+
+static int pg__dither_plane(pg_converter *conv, const pg_options *opts,
+                            pgu8 *gray, int width, int height) {
+  if (opts->dither == PG_DITHER_NONE || opts->dither >= PG_DITHER_BAYER4)
+    return 0;
+
+  if (opts->dither == PG_DITHER_FLOYD_STEINBERG) {
+    if (pg__reserve((void **)&conv->progress, &conv->progress_size,
+                    (size_t)height * PG_PROGRESS_STRIDE * sizeof(int)) != 0) {
+      fwprintf(stderr, L"Error allocate memory for dither progress.\n");
+      return -1;
+    }
+
+    conv->work_ns += pg__dither(conv->pool, conv->threads, gray, width,
+                                height, conv->progress);
+    return 0;
+  }
+
+  if (pg__reserve((void **)&conv->errors, &conv->errors_size,
+                  (size_t)3 * (width + 4) * sizeof(short)) != 0) {
+    fwprintf(stderr, L"Error allocate memory for dither errors.\n");
+    return -1;
+  }
+
+  unsigned long long start = pg__now_ns();
+
+  pg__diffuse(gray, width, height, opts->dither, conv->errors);
+  conv->work_ns += pg__now_ns() - start;
+  return 0;
+}
+
+/* Last color written on a row, for merge_colors: an RGB value, or a
+ * palette entry when encoding to a palette. */
+typedef struct {
+  int r, g, b;
+  int index;
+} ColorState;
+
+static const pgu8 *pg__palette_lut(int use_color) {
+  if (use_color == PG_COLOR_256)
+    return pg__palette_256;
+  if (use_color == PG_COLOR_16)
+    return pg__palette_16;
+
+  return NULL;
+}
+
+/* Moves last to rgb and returns whether a new color has to be written. */
+static int pg__color_update(const ThreadData *data, const pgu8 *palette,
+                            const pgu8 *rgb, ColorState *last) {
+  if (palette) {
+    int entry = palette[(rgb[0] >> 3) << 10 | (rgb[1] >> 3) << 5 | rgb[2] >> 3];
+    int changed = !data->merge_colors || entry != last->index;
+
+    last->index = entry;
+    return changed;
+  }
+
+  if (data->merge_colors && last->r >= 0 &&
+      abs(rgb[0] - last->r) <= data->color_tolerance &&
+      abs(rgb[1] - last->g) <= data->color_tolerance &&
+      abs(rgb[2] - last->b) <= data->color_tolerance)
+    return 0;
+
+  last->r = rgb[0];
+  last->g = rgb[1];
+  last->b = rgb[2];
+  return 1;
+}
+
+static void pg__color_rgb(const ColorState *state, pgu8 rgb[3]) {
+  if (state->index >= 0) {
+    pg__palette_color(state->index, rgb);
+  } else {
+    rgb[0] = (pgu8)state->r;
+    rgb[1] = (pgu8)state->g;
+    rgb[2] = (pgu8)state->b;
+  }
+}
+
+static char *pg__encode_ansi_row(const ThreadData *data, int y, char *out) {
+  const pg_grid *grid = data->grid;
+  const pgu8 *glyphs = grid->glyphs + (size_t)y * grid->cols;
+  const pgu8 *fg = grid->fg + (size_t)y * grid->cols * 3;
+  const pgu8 *bg = grid->bg ? grid->bg + (size_t)y * grid->cols * 3 : NULL;
+  const pgu8 *palette = pg__palette_lut(data->use_color);
+  ColorState last_fg = {-1, -1, -1, -1}, last_bg = {-1, -1, -1, -1};
+
+  for (int x = 0; x < grid->cols; x++) {
+    if (data->use_color) {
+      if (pg__color_update(data, palette, fg + x * 3, &last_fg))
+        out = palette ? pg__write_palette(out, data->use_color,
+                                          (pgu8)last_fg.index, 0)
+                      : pg__write_truecolor(out, fg + x * 3, 0);
+
+      if (bg && pg__color_update(data, palette, bg + x * 3, &last_bg))
+        out = palette ? pg__write_palette(out, data->use_color,
+                                          (pgu8)last_bg.index, 1)
+                      : pg__write_truecolor(out, bg + x * 3, 1);
+
+      if (!data->merge_colors) {
+        out = pg__write_glyph(out, glyphs[x]);
+
+        memcpy(out, "\033[0m", PG_RESET_LEN);
+        out += PG_RESET_LEN;
+        continue;
+      }
+    }
+
+    out = pg__write_glyph(out, glyphs[x]);
+  }
+
+  if (data->merge_colors && (last_fg.r >= 0 || last_fg.index >= 0)) {
+    memcpy(out, "\033[0m", PG_RESET_LEN);
+    out += PG_RESET_LEN;
+  }
+
+  *out++ = '\n';
+  return out;
+}
+
+static char *pg__encode_html_row(const ThreadData *data, int y, char *out) {
+  const pg_grid *grid = data->grid;
+  const pgu8 *glyphs = grid->glyphs + (size_t)y * grid->cols;
+  const pgu8 *fg = grid->fg + (size_t)y * grid->cols * 3;
+  const pgu8 *bg = grid->bg ? grid->bg + (size_t)y * grid->cols * 3 : NULL;
+  const pgu8 *palette = pg__palette_lut(data->use_color);
+  ColorState last_fg = {-1, -1, -1, -1}, last_bg = {-1, -1, -1, -1};
+  int open = 0;
+
+  for (int x = 0; x < grid->cols; x++) {
+    if (data->use_color) {
+      int changed = pg__color_update(data, palette, fg + x * 3, &last_fg);
+
+      if (bg)
+        changed |= pg__color_update(data, palette, bg + x * 3, &last_bg);
+
+      if (changed) {
+        pgu8 rgb[3];
+
+        if (open) {
+          memcpy(out, "</span>", PG_HTML_CLOSE_LEN);
+          out += PG_HTML_CLOSE_LEN;
+        }
+
+        memcpy(out, "<span style=\"color:", 19);
+        pg__color_rgb(&last_fg, rgb);
+        out = pg__write_hex(out + 19, rgb);
+
+        if (bg) {
+          memcpy(out, ";background:", 12);
+          pg__color_rgb(&last_bg, rgb);
+          out = pg__write_hex(out + 12, rgb);
+        }
+
+        memcpy(out, "\">", 2);
+        out += 2;
+        open = 1;
+      }
+    }
+
+    out = pg__write_html_glyph(out, glyphs[x]);
+  }
+
+  if (open) {
+    memcpy(out, "</span>", PG_HTML_CLOSE_LEN);
+    out += PG_HTML_CLOSE_LEN;
+  }
+
+  *out++ = '\n';
+  return out;
+}
+
+typedef struct {
+  ThreadData rows;
+  int next_row;
+} EncodeData;
+
+static void pg__rows_task(void *arg, int thread_index, int num_threads) {
+  (void)thread_index;
+  EncodeData *job = (EncodeData *)arg;
+  ThreadData data = job->rows;
+  int count = data.end_row;
+  int chunk = pg__chunk(count, num_threads);
+  ChunkTrace trace = {"render", 0};
+
+  while (pg__claim(&job->next_row, count, chunk, &data.start_row,
+                   &data.end_row, &trace))
+    process__rows(&data);
+}
+
+static int pg__check_encoding(const pg_options *opts) {
+  if (opts->use_color < PG_COLOR_NONE || opts->use_color > PG_COLOR_16) {
+    fwprintf(stderr, L"Unknown color mode %d\n", opts->use_color);
+    return -1;
+  }
+
+  if (opts->format < PG_FORMAT_ANSI || opts->format > PG_FORMAT_NONE) {
+    fwprintf(stderr, L"Unknown output format %d\n", opts->format);
+    return -1;
+  }
+
+  pthread_once(&pg__tables_once, pg__init_tables);
+
+  if (opts->use_color == PG_COLOR_256)
+    pthread_once(&pg__palette_256_once, pg__init_palette_256);
+  else if (opts->use_color == PG_COLOR_16)
+    pthread_once(&pg__palette_16_once, pg__init_palette_16);
+
+  return 0;
+}
+
+static int pg__encode(pg_encoder *enc, const pg_grid *grid,
+                      const pg_options *opts) {
+  int out_rows = grid->rows;
+  size_t out_stride = pg__line_size(grid->cols, opts, grid->bg != NULL);
+  size_t frame_size = out_stride * out_rows + 1;
+  char *bytes = enc->user_bytes;
+
+  if (bytes) {
+    if (enc->user_bytes_size < frame_size) {
+      fwprintf(stderr, L"Output buffer too small: %zu < %zu\n",
+               enc->user_bytes_size, frame_size);
+      return -1;
+    }
+  } else {
+    if (pg__reserve((void **)&enc->bytes, &enc->bytes_size, frame_size) !=
+        0) {
+      fwprintf(stderr, L"Error allocate memory for output.\n");
+      return -1;
+    }
+
+    bytes = enc->bytes;
+  }
+
+  if (pg__reserve((void **)&enc->row_offsets, &enc->row_offsets_size,
+                  (out_rows + 1) * sizeof(size_t)) != 0) {
+    fwprintf(stderr, L"Error allocate memory for output.\n");
+    return -1;
+  }
+
+  EncodeData encode_data;
+  encode_data.rows.start_row = 0;
+  encode_data.rows.end_row = out_rows;
+  encode_data.rows.format = opts->format;
+  encode_data.rows.use_color = opts->use_color;
+  encode_data.rows.merge_colors = opts->merge_colors;
+  encode_data.rows.color_tolerance = opts->color_tolerance;
+  encode_data.rows.grid = grid;
+  encode_data.rows.out = bytes;
+  encode_data.rows.out_stride = out_stride;
+  encode_data.rows.out_lengths = enc->row_offsets;
+  encode_data.next_row = 0;
+
+  enc->work_ns += pg__pool_run_n(enc->pool, enc->threads, pg__rows_task,
+                                 &encode_data);
+
+  /* Rows were rendered into fixed-size slots; close the gaps. */
+  size_t pos = 0;
+  for (int i = 0; i < out_rows; i++) {
+    size_t length = enc->row_offsets[i];
+
+    memmove(bytes + pos, bytes + i * out_stride, length);
+    enc->row_offsets[i] = pos;
+    pos += length;
+  }
+
+  enc->row_offsets[out_rows] = pos;
+  bytes[pos] = '\0';
+
+  enc->frame.data = bytes;
+  enc->frame.size = pos;
+  enc->frame.row_offsets = enc->row_offsets;
+  enc->frame.rows = out_rows;
+
+  return 0;
+}
+
+static int pg__convert(pg_converter *conv, const struct Image *image,
+                       const pg_options *opts) {
+  if (!conv->pool || pg__check_encoding(opts) != 0)
+    return -1;
+
+  if (opts->dither < PG_DITHER_NONE || opts->dither > PG_DITHER_BLUE_NOISE) {
+    fwprintf(stderr, L"Unknown dither algorithm %d\n", opts->dither);
+    return -1;
+  }
+
+  int scale, vscale;
+  pg__scales(opts, &scale, &vscale);
+
+  int out_rows = (image->height + vscale - 1) / vscale;
+  int out_cols = (image->width + scale - 1) / scale;
+  size_t cells = (size_t)out_rows * out_cols;
+
+  if (pg__reserve((void **)&conv->cells, &conv->cells_size, cells) != 0 ||
+      pg__reserve((void **)&conv->colors, &conv->colors_size, cells * 3) !=
+          0) {
+    fwprintf(stderr, L"Error allocate memory for cells.\n");
+    return -1;
+  }
+
+  if (opts->sampling != PG_SAMPLE_POINT &&
+      pg__reserve((void **)&conv->sums, &conv->sums_size,
+                  (size_t)pg_pool_size(conv->pool) * image->width *
+                      (image->channels + 1) * sizeof(pgu32)) != 0) {
+    fwprintf(stderr, L"Error allocate memory for cell sums.\n");
+    return -1;
+  }
+
+  conv->threads = pg__threads(conv->pool, opts, cells, conv->cell_ns);
+  conv->work_ns = 0;
+
+  unsigned long long mark = pg__mark(conv);
+
+  pgu8 tone[256];
+  pg__build_tone(opts, tone);
+  pg__stage(conv, "tone", PG_STAGE_TONE, &mark);
+
+  OrderedMap map;
+  const OrderedMap *ordered = pg__ordered_map(opts->dither, &map) ? &map : NULL;
+
+  SampleData sample_data;
+  sample_data.image = image;
+  sample_data.gray = NULL;
+  sample_data.tone = tone;
+  sample_data.cells = conv->cells;
+  sample_data.colors = conv->colors;
+  sample_data.out_rows = out_rows;
+  sample_data.out_cols = out_cols;
+  sample_data.scale = scale;
+  sample_data.vscale = vscale;
+  sample_data.sampling = opts->sampling;
+  sample_data.sums = conv->sums;
+  sample_data.ordered = NULL;
+  sample_data.glyphs = 1;
+  sample_data.next_row = 0;
+
+  if (opts->pipeline == PG_PIPELINE_CELLS) {
+    sample_data.ordered = ordered;
+    sample_data.glyphs = opts->dither == PG_DITHER_NONE || ordered;
+    pg__run(conv, pg__sample_task, &sample_data);
+    pg__stage(conv, "sample", PG_STAGE_SAMPLE, &mark);
+
+    if (!sample_data.glyphs) {
+      if (pg__dither_plane(conv, opts, conv->cells, out_cols, out_rows) != 0)
+        return -1;
+      pg__stage(conv, "dither", PG_STAGE_DITHER, &mark);
+
+      sample_data.next_row = 0;
+      pg__run(conv, pg__glyph_task, &sample_data);
+      pg__stage(conv, "glyphs", PG_STAGE_SAMPLE, &mark);
+    }
+  } else {
+    size_t pixels = (size_t)image->width * image->height;
+
+    if (pg__reserve((void **)&conv->gray, &conv->gray_size, pixels) != 0) {
+      fwprintf(stderr, L"Error allocate memory for gray.\n");
+      return -1;
+    }
+
+    GrayData gray_data = {image, conv->gray, tone, ordered, 0};
+    pg__run(conv, pg__gray_task, &gray_data);
+    pg__stage(conv, "gray", PG_STAGE_GRAY, &mark);
+
+    if (pg__dither_plane(conv, opts, conv->gray, image->width,
+                         image->height) != 0)
+      return -1;
+    pg__stage(conv, "dither", PG_STAGE_DITHER, &mark);
+
+    sample_data.gray = conv->gray;
+    pg__run(conv, pg__sample_task, &sample_data);
+    pg__stage(conv, "sample", PG_STAGE_SAMPLE, &mark);
+  }
+
+  conv->grid.cols = out_cols;
+  conv->grid.rows = out_rows;
+  conv->grid.glyphs = conv->cells;
+  conv->grid.fg = conv->colors;
+  conv->grid.bg = NULL;
+
+  if (opts->format == PG_FORMAT_NONE) {
+    memset(&conv->encoder.frame, 0, sizeof(pg_frame));
+  } else {
+    conv->encoder.threads = conv->threads;
+    conv->encoder.work_ns = 0;
+
+    if (pg__encode(&conv->encoder, &conv->grid, opts) != 0)
+      return -1;
+
+    conv->work_ns += conv->encoder.work_ns;
+    pg__stage(conv, "render", PG_STAGE_RENDER, &mark);
+  }
+
+  conv->stats.bytes = conv->encoder.frame.size;
+  conv->stats.cells = cells;
+  conv->stats.allocations = pg__allocations - conv->allocations;
+  conv->stats.allocated_bytes = pg__allocated_bytes - conv->allocated_bytes;
+  conv->stats.pixels = (size_t)image->width * image->height;
+  conv->stats.threads = conv->threads;
+
+  conv->cell_ns = pg__calibrate(conv->cell_ns, conv->work_ns, cells);
+  return 0;
+}
+
+PGDEF pg_converter *pg_converter_create(pg_pool *pool) {
+  return pg_converter_create_with_allocator(pool, pg__current_allocator());
+}
+
+PGDEF pg_converter *pg_converter_create_with_allocator(
+    pg_pool *pool, const pg_allocator *allocator) {
+  const pg_allocator *previous = pg__use(allocator);
+  pg_converter *conv = (pg_converter *)PG_MALLOC(sizeof(pg_converter));
+  pg__use(previous);
+
+  if (!conv) {
+    fwprintf(stderr, L"Error allocate memory for converter.\n");
+    return NULL;
+  }
+
+  memset(conv, 0, sizeof(pg_converter));
+  conv->user_pool = pool;
+  conv->cell_ns = PG_CELL_NS;
+  conv->allocator = *allocator;
+  conv->encoder.allocator = *allocator;
+
+  return conv;
+}
+
+PGDEF void pg_converter_destroy(pg_converter *conv) {
+  if (!conv)
+    return;
+
+  const pg_allocator *previous = pg__use(&conv->allocator);
+
+  PG_FREE(conv->gray);
+  PG_FREE(conv->cells);
+  PG_FREE(conv->colors);
+  PG_FREE(conv->sums);
+  PG_FREE(conv->progress);
+  PG_FREE(conv->errors);
+  PG_FREE(conv->encoder.bytes);
+  PG_FREE(conv->encoder.row_offsets);
+  pg__perf_destroy(conv->perf);
+  pg_arena_destroy(conv->scratch);
+  PG_FREE(conv);
+
+  pg__use(previous);
+}
+
+PGDEF pg_options pg_default_options(void) {
+  pg_options opts;
+  opts.scale = 8;
+  opts.aspect_ratio = 0.5f;
+  opts.pipeline = PG_PIPELINE_FULL;
+  opts.sampling = PG_SAMPLE_POINT;
+  opts.dither = PG_DITHER_FLOYD_STEINBERG;
+  opts.black_level = 0;
+  opts.white_level = 255;
+  opts.gamma = 1.0f;
+  opts.contrast = 1.1f;
+  opts.brightness = 0.0f;
+  opts.use_color = PG_COLOR_TRUECOLOR;
+  opts.merge_colors = 1;
+  opts.color_tolerance = 0;
+  opts.format = PG_FORMAT_ANSI;
+  opts.threads = 0;
+
+  return opts;
+}
+
+PGDEF size_t pg_output_size(int width, int height, const pg_options *opts) {
+  int scale, vscale;
+  pg__scales(opts, &scale, &vscale);
+
+  int out_rows = (height + vscale - 1) / vscale;
+  int out_cols = (width + scale - 1) / scale;
+
+  return pg__line_size(out_cols, opts, 0) * out_rows + 1;
+}
+
+PGDEF void pg_converter_set_output(pg_converter *conv, char *buffer,
+                                   size_t size) {
+  pg_encoder_set_output(&conv->encoder, buffer, size);
+}
+
+/* Allocator to decode with: the scratch arena, created on first use, or
+ * the converter's own allocator if that fails. */
+static const pg_allocator *pg__scratch(pg_converter *conv) {
+  if (!conv->scratch) {
+    conv->scratch = pg_arena_create(0);
+    if (conv->scratch)
+      conv->scratch_allocator = pg_arena_allocator(conv->scratch);
+  }
+
+  return conv->scratch ? &conv->scratch_allocator : &conv->allocator;
+}
+
+/* start is when decoding began, for the stats. */
+static int pg__convert_decoded(pg_converter *conv, struct Image *image,
+                               const pg_options *opts,
+                               unsigned long long start) {
+  int result = -1;
+
+  pg__stage(conv, "decode", PG_STAGE_DECODE, &start);
+
+  if (image->data) {
+    image->channels = 3;
+    image->stride = image->width * 3;
+
+    result = pg__convert(conv, image, opts);
+  } else {
+    fwprintf(stderr, L"%s\n", stbi_failure_reason());
+  }
+
+  /* Drops the image along with anything else the decoder left behind. */
+  if (conv->scratch)
+    pg_arena_reset(conv->scratch);
+  else
+    stbi_image_free(image->data);
+
+  return result;
+}
+
+PGDEF int pg_convert_file(pg_converter *conv, const char *filename,
+                          const pg_options *opts) {
+  const pg_allocator *previous = pg__use(&conv->allocator);
+  unsigned long long start = pg__begin(conv);
+  struct Image image;
+
+  pg__use(pg__scratch(conv));
+  image.data =
+      stbi_load(filename, &image.width, &image.height, &image.channels, 3);
+  pg__use(&conv->allocator);
+
+  int result = pg__convert_decoded(conv, &image, opts, start);
+
+  pg__use(previous);
+
+  return result;
+}
+
+PGDEF int pg_convert_pixels(pg_converter *conv, const pgu8 *pixels, int width,
+                            int height, int channels, int stride,
+                            const pg_options *opts) {
+  if (!pixels || width <= 0 || height <= 0 || channels < 1 || channels > 4 ||
+      (stride != 0 && stride < width * channels)) {
+    fwprintf(stderr, L"Invalid pixel buffer.\n");
+    return -1;
+  }
+
+  struct Image image;
+  image.width = width;
+  image.height = height;
+  image.channels = channels;
+  image.stride = stride != 0 ? stride : width * channels;
+  image.data = (pgu8 *)pixels;
+
+  const pg_allocator *previous = pg__use(&conv->allocator);
+
+  pg__begin(conv);
+  int result = pg__convert(conv, &image, opts);
+
+  pg__use(previous);
+
+  return result;
+}
+
+PGDEF int pg_convert_memory(pg_converter *conv, const pgu8 *buffer, int size,
+                            const pg_options *opts) {
+  const pg_allocator *previous = pg__use(&conv->allocator);
+  unsigned long long start = pg__begin(conv);
+  struct Image image;
+
+  pg__use(pg__scratch(conv));
+  image.data = stbi_load_from_memory(buffer, size, &image.width, &image.height,
+                                     &image.channels, 3);
+  pg__use(&conv->allocator);
+
+  int result = pg__convert_decoded(conv, &image, opts, start);
+
+  pg__use(previous);
+
+  return result;
+}
+
+PGDEF int pg_convert_callbacks(pg_converter *conv,
+                               const pg_io_callbacks *callbacks, void *user,
+                               const pg_options *opts) {
+  stbi_io_callbacks io;
+  io.read = callbacks->read;
+  io.skip = callbacks->skip;
+  io.eof = callbacks->eof;
+
+  const pg_allocator *previous = pg__use(&conv->allocator);
+  unsigned long long start = pg__begin(conv);
+  struct Image image;
+
+  pg__use(pg__scratch(conv));
+  image.data = stbi_load_from_callbacks(&io, user, &image.width, &image.height,
+                                        &image.channels, 3);
+  pg__use(&conv->allocator);
+
+  int result = pg__convert_decoded(conv, &image, opts, start);
+
+  pg__use(previous);
+
+  return result;
+}
+
+PGDEF const pg_frame *pg_converter_frame(const pg_converter *conv) {
+  return &conv->encoder.frame;
+}
+
+PGDEF void pg_converter_set_stats(pg_converter *conv, int enable) {
+  conv->stats_enabled = enable != 0;
+  memset(&conv->stats, 0, sizeof(pg_stats));
+
+  if (!enable) {
+    const pg_allocator *previous = pg__use(&conv->allocator);
+    pg__perf_destroy(conv->perf);
+    conv->perf = NULL;
+    pg__use(previous);
+  }
+}
+
+PGDEF int pg_converter_set_counters(pg_converter *conv, int enable) {
+  pg_converter_set_stats(conv, 0);
+  if (!enable)
+    return 0;
+
+  pg_converter_set_stats(conv, 1);
+
+  pg__bind_pool(conv);
+  if (!conv->pool)
+    return -1;
+
+  const pg_allocator *previous = pg__use(&conv->allocator);
+  conv->perf = pg__perf_create(conv->pool);
+  conv->stats.counters_enabled = conv->perf != NULL;
+  pg__use(previous);
+
+  return conv->perf ? 0 : -1;
+}
+
+PGDEF const pg_stats *pg_converter_stats(const pg_converter *conv) {
+  return conv->stats_enabled ? &conv->stats : NULL;
+}
+
+PGDEF int pg_converter_write(pg_converter *conv, int fd) {
+  pg__bind_pool(conv);
+
+  unsigned long long start = pg__mark(conv);
+  int result = pg_frame_write(&conv->encoder.frame, fd);
+
+  conv->stats.write_ns = 0;
+  memset(conv->stats.counters[PG_STAGE_WRITE], 0,
+         sizeof(conv->stats.counters[PG_STAGE_WRITE]));
+  pg__stage(conv, "write", PG_STAGE_WRITE, &start);
+
+  return result;
+}
+
+/* value / per, or n/a for an event that could not be counted. */
+static void pg__print_counter(long long value, double per) {
+  if (value < 0 || per <= 0)
+    fwprintf(stderr, L" %9ls", L"n/a");
+  else
+    fwprintf(stderr, L" %9.3f", value / per);
+}
+
+PGDEF void pg_stats_print(const pg_stats *stats) {
+  static const wchar_t *names[] = {L"decode", L"tone",   L"gray", L"sample",
+                                   L"dither", L"render", L"write"};
+  const unsigned long long stages[] = {
+      stats->decode_ns, stats->tone_ns,   stats->gray_ns,  stats->sample_ns,
+      stats->dither_ns, stats->render_ns, stats->write_ns};
+  unsigned long long total = 0;
+
+  if (stats->counters_enabled)
+    fwprintf(stderr, L"%-8ls %13ls %9ls %9ls %9ls %9ls %9ls\n", L"stage",
+             L"time", L"Mcycles", L"IPC", L"L1D/px", L"LLC/px", L"br/px");
+
+  for (int i = 0; i < PG_STAGE_COUNT; i++) {
+    fwprintf(stderr, L"%-8ls %10.3f ms", names[i], stages[i] / 1e6);
+    total += stages[i];
+
+    if (stats->counters_enabled) {
+      const long long *counters = stats->counters[i];
+      long long cycles = counters[PG_COUNTER_CYCLES];
+      double pixels = (double)stats->pixels;
+
+      pg__print_counter(cycles, 1e6);
+      pg__print_counter(cycles < 0 ? -1 : counters[PG_COUNTER_INSTRUCTIONS],
+                        (double)cycles);
+      pg__print_counter(counters[PG_COUNTER_L1D_MISSES], pixels);
+      pg__print_counter(counters[PG_COUNTER_LLC_MISSES], pixels);
+      pg__print_counter(counters[PG_COUNTER_BRANCH_MISSES], pixels);
+    }
+    fwprintf(stderr, L"\n");
+  }
+
+  fwprintf(stderr, L"%-8ls %10.3f ms\n", L"total", total / 1e6);
+  fwprintf(stderr,
+           L"threads %d, cells %zu, bytes %zu, allocations %zu (%zu bytes)\n",
+           stats->threads, stats->cells, stats->bytes, stats->allocations,
+           stats->allocated_bytes);
+}
+
+PGDEF const pg_grid *pg_converter_grid(const pg_converter *conv) {
+  return &conv->grid;
+}
+
+PGDEF int pg_grid_copy(pg_grid *dst, const pg_grid *src) {
+  size_t cells = (size_t)src->cols * src->rows;
+
+  if ((size_t)dst->cols * dst->rows != cells || !dst->glyphs ||
+      !dst->bg != !src->bg) {
+    pg_grid_free(dst);
+
+    dst->glyphs = (pgu8 *)PG_MALLOC(cells);
+    dst->fg = (pgu8 *)PG_MALLOC(cells * 3);
+    dst->bg = src->bg ? (pgu8 *)PG_MALLOC(cells * 3) : NULL;
+
+    if (!dst->glyphs || !dst->fg || (src->bg && !dst->bg)) {
+      fwprintf(stderr, L"Error allocate memory for grid.\n");
+      pg_grid_free(dst);
+      return -1;
+    }
+  }
+
+  dst->cols = src->cols;
+  dst->rows = src->rows;
+  memcpy(dst->glyphs, src->glyphs, cells);
+  memcpy(dst->fg, src->fg, cells * 3);
+  if (src->bg)
+    memcpy(dst->bg, src->bg, cells * 3);
+
+  return 0;
+}
+
+PGDEF void pg_grid_free(pg_grid *grid) {
+  PG_FREE(grid->glyphs);
+  PG_FREE(grid->fg);
+  PG_FREE(grid->bg);
+  memset(grid, 0, sizeof(pg_grid));
+}
+
+PGDEF int pg_grid_diff(const pg_grid *a, const pg_grid *b, pgu8 *changed) {
+  if (a->cols != b->cols || a->rows != b->rows || !a->bg != !b->bg)
+    return -1;
+
+  size_t cols = (size_t)a->cols;
+  int count = 0;
+
+  for (int y = 0; y < a->rows; y++) {
+    size_t row = y * cols;
+    int differs = memcmp(a->glyphs + row, b->glyphs + row, cols) != 0 ||
+                  memcmp(a->fg + row * 3, b->fg + row * 3, cols * 3) != 0 ||
+                  (a->bg &&
+                   memcmp(a->bg + row * 3, b->bg + row * 3, cols * 3) != 0);
+
+    if (changed)
+      changed[y] = (pgu8)differs;
+    count += differs;
+  }
+
+  return count;
+}
+
+PGDEF pg_encoder *pg_encoder_create(pg_pool *pool) {
+  pg_encoder *enc = (pg_encoder *)PG_MALLOC(sizeof(pg_encoder));
+  if (!enc) {
+    fwprintf(stderr, L"Error allocate memory for encoder.\n");
+    return NULL;
+  }
+
+  memset(enc, 0, sizeof(pg_encoder));
+  enc->user_pool = pool;
+  enc->cell_ns = PG_CELL_NS;
+  enc->allocator = *pg__current_allocator();
+
+  return enc;
+}
+
+PGDEF void pg_encoder_destroy(pg_encoder *enc) {
+  if (!enc)
+    return;
+
+  const pg_allocator *previous = pg__use(&enc->allocator);
+
+  PG_FREE(enc->bytes);
+  PG_FREE(enc->row_offsets);
+  PG_FREE(enc);
+
+  pg__use(previous);
+}
+
+PGDEF void pg_encoder_set_output(pg_encoder *enc, char *buffer, size_t size) {
+  enc->user_bytes = buffer;
+  enc->user_bytes_size = buffer ? size : 0;
+}
+
+PGDEF size_t pg_encode_size(const pg_grid *grid, const pg_options *opts) {
+  return pg__line_size(grid->cols, opts, grid->bg != NULL) * grid->rows + 1;
+}
+
+PGDEF int pg_encode(pg_encoder *enc, const pg_grid *grid,
+                    const pg_options *opts) {
+  if (pg__check_encoding(opts) != 0)
+    return -1;
+
+  if (opts->format == PG_FORMAT_NONE) {
+    memset(&enc->frame, 0, sizeof(pg_frame));
+    return 0;
+  }
+
+  enc->pool = enc->user_pool ? enc->user_pool : pg__default_pool();
+  if (!enc->pool)
+    return -1;
+
+  size_t cells = (size_t)grid->cols * grid->rows;
+
+  enc->threads = pg__threads(enc->pool, opts, cells, enc->cell_ns);
+  enc->work_ns = 0;
+
+  const pg_allocator *previous = pg__use(&enc->allocator);
+  int result = pg__encode(enc, grid, opts);
+  pg__use(previous);
+
+  if (result != 0)
+    return -1;
+
+  enc->cell_ns = pg__calibrate(enc->cell_ns, enc->work_ns, cells);
+  return 0;
+}
+
+PGDEF const pg_frame *pg_encoder_frame(const pg_encoder *enc) {
+  return &enc->frame;
+}
+
+PGDEF int pg_frame_write(const pg_frame *frame, int fd) {
+  size_t pos = 0;
+
+  while (pos < frame->size) {
+    ssize_t n = write(fd, frame->data + pos, frame->size - pos);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+
+      fwprintf(stderr, L"Error write frame: %s\n", strerror(errno));
+      return -1;
+    }
+
+    pos += (size_t)n;
+  }
+
+  return 0;
+}
+
+PGDEF void convert_image_to_ascii(const char *filename, int scale,
+                                  float aspect_ratio) {
+  pthread_mutex_lock(&pg__converter_lock);
+
+  if (!pg__converter)
+    pg__converter = pg_converter_create(NULL);
+
+  pg_converter *conv = pg__converter;
+  if (!conv) {
+    pthread_mutex_unlock(&pg__converter_lock);
+    return;
+  }
+
+  pg_options opts = pg_default_options();
+  opts.scale = scale;
+  opts.aspect_ratio = aspect_ratio;
+
+  if (pg_convert_file(conv, filename, &opts) == 0) {
+    wprintf(L"Using %d thread(s)\n", conv->threads);
+    fflush(stdout);
+
+    pg_converter_write(conv, STDOUT_FILENO);
+  }
+
+  pthread_mutex_unlock(&pg__converter_lock);
+}
+
+PGDEF void apply__contrast(pgu8 *gray, int width, int height, float contrast) {
+  int size = width * height;
+  for (int i = 0; i < size; i++) {
+    float val = gray[i];
+
+    val = (val - 128.0f) * contrast + 128.0f;
+    if (val < 0)
+      val = 0;
+    if (val > 255)
+      val = 255;
+    gray[i] = (pgu8)val;
+  }
+}
+
+PGDEF void floyd__steinberg_dither(pgu8 *gray, int width, int height) {
+  for (int y = 0; y < height; y++)
+    for (int x = 0; x < width; x++)
+      pg__fs_pixel(gray, width, height, x, y);
+}
+
+PGDEF void floyd__steinberg_dither_wavefront(pg_pool *pool, pgu8 *gray,
+                                             int width, int height) {
+  int *progress =
+      (int *)PG_MALLOC((size_t)height * PG_PROGRESS_STRIDE * sizeof(int));
+  if (!progress) {
+    fwprintf(stderr, L"Error allocate memory for dither progress.\n");
+    floyd__steinberg_dither(gray, width, height);
+    return;
+  }
+
+  pg__dither(pool, pg_pool_size(pool), gray, width, height, progress);
+
+  PG_FREE(progress);
+}
+
+PGDEF void *process__rows(void *arg) {
+  ThreadData *data = (ThreadData *)arg;
+
+  for (int out_y = data->start_row; out_y < data->end_row; out_y++) {
+    char *line = data->out + out_y * data->out_stride;
+    char *end = data->format == PG_FORMAT_HTML
+                    ? pg__encode_html_row(data, out_y, line)
+                    : pg__encode_ansi_row(data, out_y, line);
+
+    data->out_lengths[out_y] = end - line;
+  }
+
+  return NULL;
+}
+
+static unsigned long long pg__pool_task(pg_pool *pool, int worker, int index,
+                                        int num_threads, pg_task task,
+                                        void *arg) {
+  unsigned long long start = pg__now_ns();
+
+  task(arg, index, num_threads);
+
+  unsigned long long elapsed = pg__now_ns() - start;
+  __atomic_fetch_add(&pool->workers[worker].busy_ns, elapsed,
+                     __ATOMIC_RELAXED);
+
+  return elapsed;
+}
+
+static void *pg__pool_worker(void *arg) {
+  PoolWorker *worker = (PoolWorker *)arg;
+  pg_pool *pool = worker->pool;
+
+  pg__trace_worker = worker->index;
+  __atomic_store_n(&worker->tid, pg__gettid(), __ATOMIC_RELEASE);
+
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->shutdown && !worker->job)
+      pthread_cond_wait(&worker->wake, &pool->lock);
+
+    if (pool->shutdown) {
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+
+    PoolJob *job = worker->job;
+    int index = worker->job_index;
+    int num_threads = job->num_threads;
+    pthread_mutex_unlock(&pool->lock);
+
+    unsigned long long elapsed = pg__pool_task(
+        pool, worker->index, index, num_threads, job->task, job->arg);
+
+    /* job lives on its caller's stack: done with it once pending drops. */
+    pthread_mutex_lock(&pool->lock);
+    job->run_ns += elapsed;
+    worker->job = NULL;
+    pool->idle[pool->idle_count++] = worker->index;
+    if (--job->pending == 0)
+      pthread_cond_broadcast(&pool->done);
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  return NULL;
+}
+
+PGDEF pg_pool *pg_pool_create(int num_threads) {
+  if (num_threads <= 0)
+    num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_threads <= 0)
+    num_threads = 1;
+
+  pg_pool *pool = (pg_pool *)PG_MALLOC(sizeof(pg_pool));
+  if (!pool) {
+    fwprintf(stderr, L"Error allocate memory for thread pool.\n");
+    return NULL;
+  }
+
+  memset(pool, 0, sizeof(pg_pool));
+  pool->id = __atomic_add_fetch(&pg__pool_ids, 1, __ATOMIC_RELAXED);
+  pool->allocator = *pg__current_allocator();
+  pool->num_threads = num_threads;
+  pool->threads = (pthread_t *)PG_MALLOC(num_threads * sizeof(pthread_t));
+  pool->workers = (PoolWorker *)PG_MALLOC(num_threads * sizeof(PoolWorker));
+  pool->idle = (int *)PG_MALLOC(num_threads * sizeof(int));
+
+  if (!pool->threads || !pool->workers || !pool->idle) {
+    fwprintf(stderr, L"Error allocate memory for thread pool.\n");
+
+    PG_FREE(pool->threads);
+    PG_FREE(pool->workers);
+    PG_FREE(pool->idle);
+    PG_FREE(pool);
+
+    return NULL;
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  for (int i = 0; i < num_threads; i++) {
+    pool->workers[i].pool = pool;
+    pool->workers[i].index = i;
+    pool->workers[i].job = NULL;
+    pool->workers[i].job_index = 0;
+    pool->workers[i].busy_ns = 0;
+    pool->workers[i].tid = 0;
+  }
+
+  for (int i = 1; i < num_threads; i++) {
+    pthread_cond_init(&pool->workers[i].wake, NULL);
+
+    if (pthread_create(&pool->threads[i], NULL, pg__pool_worker,
+                       &pool->workers[i]) != 0) {
+      fwprintf(stderr, L"Error create thread %d\n", i);
+
+      pthread_cond_destroy(&pool->workers[i].wake);
+      pool->num_threads = i;
+      break;
+    }
+  }
+
+  /* Worker 1 first, so a lone job always gets the same threads. */
+  for (int i = pool->num_threads - 1; i >= 1; i--)
+    pool->idle[pool->idle_count++] = i;
+
+  return pool;
+}
+
+PGDEF void pg_pool_destroy(pg_pool *pool) {
+  if (!pool)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = 1;
+  for (int i = 1; i < pool->num_threads; i++)
+    pthread_cond_signal(&pool->workers[i].wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 1; i < pool->num_threads; i++) {
+    pthread_join(pool->threads[i], NULL);
+    pthread_cond_destroy(&pool->workers[i].wake);
+  }
+
+  pthread_cond_destroy(&pool->done);
+  pthread_mutex_destroy(&pool->lock);
+
+  const pg_allocator *previous = pg__use(&pool->allocator);
+
+  PG_FREE(pool->idle);
+  PG_FREE(pool->workers);
+  PG_FREE(pool->threads);
+  PG_FREE(pool);
+
+  pg__use(previous);
+}
+
+PGDEF int pg_pool_size(const pg_pool *pool) { return pool->num_threads; }
+
+PGDEF void pg_pool_busy(const pg_pool *pool, unsigned long long *busy_ns) {
+  for (int i = 0; i < pool->num_threads; i++)
+    busy_ns[i] = __atomic_load_n(&pool->workers[i].busy_ns, __ATOMIC_RELAXED);
+}
+
+PGDEF void pg_pool_reset_busy(pg_pool *pool) {
+  for (int i = 0; i < pool->num_threads; i++)
+    __atomic_store_n(&pool->workers[i].busy_ns, 0, __ATOMIC_RELAXED);
+}
+
+/* Runs task on the caller and up to num_threads - 1 workers, waking no
+ * others, and returns the time all of them spent in it. Only idle workers
+ * are handed out, so concurrent callers split the pool between them and a
+ * caller finding none idle runs alone rather than waiting. Tasks claim
+ * their work dynamically and get the real count as num_threads. */
+static unsigned long long pg__pool_run_n(pg_pool *pool, int num_threads,
+                                         pg_task task, void *arg) {
+  if (num_threads > pool->num_threads)
+    num_threads = pool->num_threads;
+  if (num_threads <= 1)
+    return pg__pool_task(pool, 0, 0, 1, task, arg);
+
+  PoolJob job = {task, arg, 1, 0, 0};
+
+  pthread_mutex_lock(&pool->lock);
+  while (job.num_threads < num_threads && pool->idle_count > 0) {
+    PoolWorker *worker = &pool->workers[pool->idle[--pool->idle_count]];
+
+    worker->job = &job;
+    worker->job_index = job.num_threads++;
+    pthread_cond_signal(&worker->wake);
+  }
+  job.pending = job.num_threads - 1;
+  pthread_mutex_unlock(&pool->lock);
+
+  unsigned long long run_ns =
+      pg__pool_task(pool, 0, 0, job.num_threads, task, arg);
+
+  pthread_mutex_lock(&pool->lock);
+  while (job.pending > 0)
+    pthread_cond_wait(&pool->done, &pool->lock);
+  run_ns += job.run_ns;
+  pthread_mutex_unlock(&pool->lock);
+
+  return run_ns;
+}
+
+PGDEF void pg_pool_run(pg_pool *pool, pg_task task, void *arg) {
+  pg__pool_run_n(pool, pool->num_threads, task, arg);
+}
+
+PGDEF int pg_init(int num_threads) {
+  pg_pool *pool = pg_pool_create(num_threads);
+  if (!pool)
+    return -1;
+
+  pthread_mutex_lock(&pg__converter_lock);
+  pg_converter_destroy(pg__converter);
+  pg__converter = NULL;
+  pthread_mutex_unlock(&pg__converter_lock);
+
+  pthread_mutex_lock(&pg__pool_lock);
+  pg_pool *old = pg__pool;
+  pg__pool = pool;
+  pthread_mutex_unlock(&pg__pool_lock);
+
+  pg_pool_destroy(old);
+
+  return 0;
+}
+
+PGDEF void pg_shutdown(void) {
+  pthread_mutex_lock(&pg__converter_lock);
+  pg_converter_destroy(pg__converter);
+  pg__converter = NULL;
+  pthread_mutex_unlock(&pg__converter_lock);
+
+  pthread_mutex_lock(&pg__pool_lock);
+  pg_pool *pool = pg__pool;
+  pg__pool = NULL;
+  pthread_mutex_unlock(&pg__pool_lock);
+
+  pg_pool_destroy(pool);
+
+  pg_trace_stop();
+}
+
+PGDEF void pg_set_allocator(const pg_allocator *allocator) {
+  if (allocator) {
+    pg__global_allocator = *allocator;
+  } else {
+    pg__global_allocator.allocate = pg__libc_allocate;
+    pg__global_allocator.reallocate = pg__libc_reallocate;
+    pg__global_allocator.deallocate = pg__libc_deallocate;
+    pg__global_allocator.user = NULL;
+  }
+}
+
+#define PG_COUNTING_HEADER 16 /* size prefix, keeps malloc's alignment */
+
+/* Moves live from remove to add bytes, refusing growth past the limit when
+ * enforce is set. */
+static int pg__counting_charge(pg_counting *counting, size_t add,
+                               size_t remove, int enforce) {
+  size_t live = __atomic_load_n(&counting->live, __ATOMIC_RELAXED);
+  size_t next;
+
+  do {
+    next = live - remove + add;
+    if (enforce && counting->limit && add > remove &&
+        next > counting->limit) {
+      __atomic_fetch_add(&counting->failed, 1, __ATOMIC_RELAXED);
+      return -1;
+    }
+  } while (!__atomic_compare_exchange_n(&counting->live, &live, next, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  size_t peak = __atomic_load_n(&counting->peak, __ATOMIC_RELAXED);
+  while (next > peak &&
+         !__atomic_compare_exchange_n(&counting->peak, &peak, next, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+
+  return 0;
+}
+
+static void *pg__counting_reallocate(void *user, void *ptr, size_t size) {
+  pg_counting *counting = (pg_counting *)user;
+  char *raw = ptr ? (char *)ptr - PG_COUNTING_HEADER : NULL;
+  size_t old = raw ? *(size_t *)raw : 0;
+
+  if (pg__counting_charge(counting, size, old, 1) != 0)
+    return NULL;
+
+  char *grown = (char *)realloc(raw, size + PG_COUNTING_HEADER);
+  if (!grown) {
+    pg__counting_charge(counting, old, size, 0);
+    __atomic_fetch_add(&counting->failed, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  *(size_t *)grown = size;
+  __atomic_fetch_add(&counting->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&counting->bytes, size, __ATOMIC_RELAXED);
+
+  return grown + PG_COUNTING_HEADER;
+}
+
+static void *pg__counting_allocate(void *user, size_t size) {
+  return pg__counting_reallocate(user, NULL, size);
+}
+
+static void pg__counting_deallocate(void *user, void *ptr) {
+  if (!ptr)
+    return;
+
+  char *raw = (char *)ptr - PG_COUNTING_HEADER;
+  pg__counting_charge((pg_counting *)user, 0, *(size_t *)raw, 0);
+  free(raw);
+}
+
+PGDEF pg_allocator pg_counting_allocator(pg_counting *counting) {
+  pg_allocator allocator;
+  allocator.allocate = pg__counting_allocate;
+  allocator.reallocate = pg__counting_reallocate;
+  allocator.deallocate = pg__counting_deallocate;
+  allocator.user = counting;
+
+  return allocator;
+}
+
+PGDEF void pg_counting_reset(pg_counting *counting) {
+  __atomic_store_n(&counting->count, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&counting->bytes, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&counting->failed, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&counting->peak,
+                   __atomic_load_n(&counting->live, __ATOMIC_RELAXED),
+                   __ATOMIC_RELAXED);
+}
+
+typedef struct ArenaBlock {
+  struct ArenaBlock *next;
+  size_t size; /* usable bytes after the header */
+  size_t used;
+  size_t mapped; /* bytes to munmap, 0 for blocks from the backing allocator */
+} ArenaBlock;
+
+/* One thread's part of an arena. Only that thread touches it between
+ * resets. */
+typedef struct ArenaShard {
+  struct ArenaShard *next;
+  int tid;
+  ArenaBlock *blocks; /* newest first; allocations come from the head */
+  size_t used;        /* over all blocks since the last reset */
+  size_t peak;        /* most used since the last reset */
+  char *top;          /* newest allocation, the only one free gives back */
+} ArenaShard;
+
+struct pg_arena {
+  pthread_mutex_t lock;
+  ArenaShard *shards;
+  size_t block_size;
+  unsigned id;
+  pg_allocator backing;
+};
+
+#define PG_ARENA_HEADER                                                        \
+  ((sizeof(ArenaBlock) + PG_ARENA_ALIGN - 1) & ~(size_t)(PG_ARENA_ALIGN - 1))
+
+static unsigned pg__arena_ids = 0;
+/* Shard of the arena this thread used last, so lookups skip the lock. */
+static __thread unsigned pg__arena_cached = 0;
+static __thread ArenaShard *pg__arena_cached_shard = NULL;
+
+static size_t pg__arena_round(size_t size) {
+  return (size + PG_ARENA_ALIGN - 1) & ~(size_t)(PG_ARENA_ALIGN - 1);
+}
+
+static char *pg__arena_data(ArenaBlock *block) {
+  return (char *)block + PG_ARENA_HEADER;
+}
+
+static ArenaBlock *pg__arena_block(pg_arena *arena, size_t size) {
+  size_t total = PG_ARENA_HEADER + size;
+  ArenaBlock *block = NULL;
+  size_t mapped = 0;
+
+#ifdef MAP_ANONYMOUS
+  if (total >= PG_ARENA_HUGE && arena->backing.allocate == pg__libc_allocate) {
+    /* Map with room to align to a huge page at both ends, then trim. */
+    total = (total + PG_ARENA_HUGE - 1) & ~(size_t)(PG_ARENA_HUGE - 1);
+    char *map = (char *)mmap(NULL, total + PG_ARENA_HUGE,
+                             PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (map != (char *)MAP_FAILED) {
+      char *aligned = (char *)(((uintptr_t)map + PG_ARENA_HUGE - 1) &
+                               ~(uintptr_t)(PG_ARENA_HUGE - 1));
+      if (aligned > map)
+        munmap(map, aligned - map);
+      if (map + PG_ARENA_HUGE > aligned)
+        munmap(aligned + total, map + PG_ARENA_HUGE - aligned);
+#ifdef MADV_HUGEPAGE
+      madvise(aligned, total, MADV_HUGEPAGE);
+#endif
+      block = (ArenaBlock *)aligned;
+      mapped = total;
+    }
+  }
+#endif
+
+  if (!block) {
+    block = (ArenaBlock *)arena->backing.allocate(arena->backing.user, total);
+    if (!block)
+      return NULL;
+  }
+
+  block->next = NULL;
+  block->size = total - PG_ARENA_HEADER;
+  block->used = 0;
+  block->mapped = mapped;
+
+  return block;
+}
+
+static void pg__arena_free_blocks(pg_arena *arena, ArenaBlock *block) {
+  while (block) {
+    ArenaBlock *next = block->next;
+    if (block->mapped)
+      munmap(block, block->mapped);
+    else
+      arena->backing.deallocate(arena->backing.user, block);
+    block = next;
+  }
+}
+
+static ArenaShard *pg__arena_shard(pg_arena *arena) {
+  if (pg__arena_cached == arena->id)
+    return pg__arena_cached_shard;
+
+  int tid = pg__gettid();
+
+  pthread_mutex_lock(&arena->lock);
+
+  ArenaShard *shard = arena->shards;
+  while (shard && shard->tid != tid)
+    shard = shard->next;
+
+  if (!shard) {
+    shard = (ArenaShard *)arena->backing.allocate(arena->backing.user,
+                                                  sizeof(ArenaShard));
+    if (shard) {
+      memset(shard, 0, sizeof(ArenaShard));
+      shard->tid = tid;
+      shard->next = arena->shards;
+      arena->shards = shard;
+    }
+  }
+
+  pthread_mutex_unlock(&arena->lock);
+
+  if (shard) {
+    pg__arena_cached = arena->id;
+    pg__arena_cached_shard = shard;
+  }
+
+  return shard;
+}
+
+static void *pg__arena_allocate(void *user, size_t size) {
+  pg_arena *arena = (pg_arena *)user;
+  ArenaShard *shard = pg__arena_shard(arena);
+
+  if (!shard || size > ((size_t)-1) / 2)
+    return NULL;
+
+  size_t need = PG_ARENA_ALIGN + pg__arena_round(size);
+  ArenaBlock *block = shard->blocks;
+
+  if (!block || block->size - block->used < need) {
+    size_t grow = block ? block->size * 2 : arena->block_size;
+
+    block = pg__arena_block(arena, grow > need ? grow : need);
+    if (!block)
+      return NULL;
+
+    block->next = shard->blocks;
+    shard->blocks = block;
+  }
+
+  char *header = pg__arena_data(block) + block->used;
+  *(size_t *)header = size;
+
+  block->used += need;
+  shard->used += need;
+  if (shard->used > shard->peak)
+    shard->peak = shard->used;
+
+  shard->top = header + PG_ARENA_ALIGN;
+  return shard->top;
+}
+
+static void *pg__arena_reallocate(void *user, void *ptr, size_t size) {
+  if (!ptr)
+    return pg__arena_allocate(user, size);
+
+  ArenaShard *shard = pg__arena_shard((pg_arena *)user);
+  size_t *header = (size_t *)((char *)ptr - PG_ARENA_ALIGN);
+  size_t old = *header;
+
+  /* The newest allocation grows or shrinks in place while its block has
+   * room. */
+  if (shard && ptr == shard->top && size <= ((size_t)-1) / 2) {
+    ArenaBlock *block = shard->blocks;
+    size_t old_need = pg__arena_round(old);
+    size_t new_need = pg__arena_round(size);
+
+    if (new_need <= old_need ||
+        block->size - block->used >= new_need - old_need) {
+      block->used = block->used - old_need + new_need;
+      shard->used = shard->used - old_need + new_need;
+      if (shard->used > shard->peak)
+        shard->peak = shard->used;
+      *header = size;
+      return ptr;
+    }
+  }
+
+  void *moved = pg__arena_allocate(user, size);
+  if (moved)
+    memcpy(moved, ptr, old < size ? old : size);
+
+  return moved;
+}
+
+static void pg__arena_deallocate(void *user, void *ptr) {
+  ArenaShard *shard = pg__arena_shard((pg_arena *)user);
+
+  if (!shard || !ptr || ptr != shard->top)
+    return;
+
+  size_t need = PG_ARENA_ALIGN +
+                pg__arena_round(*(size_t *)((char *)ptr - PG_ARENA_ALIGN));
+  shard->blocks->used -= need;
+  shard->used -= need;
+  shard->top = NULL;
+}
+
+PGDEF pg_arena *pg_arena_create(size_t block_size) {
+  const pg_allocator *backing = pg__current_allocator();
+  pg_arena *arena =
+      (pg_arena *)backing->allocate(backing->user, sizeof(pg_arena));
+
+  if (!arena) {
+    fwprintf(stderr, L"Error allocate memory for arena.\n");
+    return NULL;
+  }
+
+  memset(arena, 0, sizeof(pg_arena));
+  pthread_mutex_init(&arena->lock, NULL);
+  arena->block_size = block_size ? block_size : PG_ARENA_BLOCK;
+  arena->id = __atomic_add_fetch(&pg__arena_ids, 1, __ATOMIC_RELAXED);
+  arena->backing = *backing;
+
+  return arena;
+}
+
+PGDEF void pg_arena_destroy(pg_arena *arena) {
+  if (!arena)
+    return;
+
+  ArenaShard *shard = arena->shards;
+  while (shard) {
+    ArenaShard *next = shard->next;
+    pg__arena_free_blocks(arena, shard->blocks);
+    arena->backing.deallocate(arena->backing.user, shard);
+    shard = next;
+  }
+
+  if (pg__arena_cached == arena->id)
+    pg__arena_cached = 0;
+
+  pg_allocator backing = arena->backing;
+  pthread_mutex_destroy(&arena->lock);
+  backing.deallocate(backing.user, arena);
+}
+
+PGDEF void pg_arena_reset(pg_arena *arena) {
+  pthread_mutex_lock(&arena->lock);
+
+  for (ArenaShard *shard = arena->shards; shard; shard = shard->next) {
+    size_t size =
+        shard->peak > arena->block_size ? shard->peak : arena->block_size;
+
+    /* A block over four times this cycle's needs is given back, so one
+     * large cycle does not pin its memory for the arena's whole life. */
+    if (shard->blocks &&
+        (shard->blocks->next || shard->blocks->size / 4 > size)) {
+      pg__arena_free_blocks(arena, shard->blocks);
+      shard->blocks = pg__arena_block(arena, size);
+    } else if (shard->blocks) {
+      shard->blocks->used = 0;
+    }
+
+    shard->used = 0;
+    shard->peak = 0;
+    shard->top = NULL;
+  }
+
+  pthread_mutex_unlock(&arena->lock);
+}
+
+PGDEF pg_allocator pg_arena_allocator(pg_arena *arena) {
+  pg_allocator allocator;
+  allocator.allocate = pg__arena_allocate;
+  allocator.reallocate = pg__arena_reallocate;
+  allocator.deallocate = pg__arena_deallocate;
+  allocator.user = arena;
+
+  return allocator;
+}
+
+PGDEF size_t pg_arena_reserved(pg_arena *arena) {
+  size_t reserved = 0;
+
+  pthread_mutex_lock(&arena->lock);
+  for (ArenaShard *shard = arena->shards; shard; shard = shard->next)
+    for (ArenaBlock *block = shard->blocks; block; block = block->next)
+      reserved += PG_ARENA_HEADER + block->size;
+  pthread_mutex_unlock(&arena->lock);
+
+  return reserved;
+}
+
+PGDEF int pg_trace_start(const char *path) {
+  pg_trace_stop();
+
+  pg__trace_path = (char *)PG_MALLOC(strlen(path) + 1);
+  if (!pg__trace_path) {
+    fwprintf(stderr, L"Error allocate memory for trace.\n");
+    return -1;
+  }
+
+  strcpy(pg__trace_path, path);
+
+  __atomic_fetch_add(&pg__trace_generation, 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&pg__trace_enabled, 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+static int pg__trace_write(FILE *file, TraceBuffer *buffers) {
+  int pid = (int)getpid();
+  const char *separator = "";
+
+  fputs("{\"traceEvents\":[", file);
+
+  for (TraceBuffer *buffer = buffers; buffer; buffer = buffer->next) {
+    size_t count = __atomic_load_n(&buffer->count, __ATOMIC_ACQUIRE);
+
+    if (buffer->worker > 0) {
+      fprintf(file,
+              "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+              "\"tid\":%d,\"args\":{\"name\":\"pool worker %d\"}}",
+              separator, pid, buffer->tid, buffer->worker);
+      separator = ",";
+    }
+
+    for (size_t i = 0; i < count; i++) {
+      const TraceEvent *event = &buffer->events[i];
+
+      fprintf(file,
+              "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+              "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+              separator, event->name,
+              event->begin_row < 0 ? "stage" : "chunk",
+              event->start_ns / 1e3, (event->end_ns - event->start_ns) / 1e3,
+              pid, buffer->tid);
+      if (event->begin_row >= 0)
+        fprintf(file, ",\"args\":{\"rows\":\"%d-%d\"}", event->begin_row,
+                event->end_row);
+      fputc('}', file);
+      separator = ",";
+    }
+
+    if (buffer->dropped)
+      fwprintf(stderr, L"Trace of thread %d dropped %zu events\n",
+               buffer->tid, buffer->dropped);
+  }
+
+  fputs("\n],\"displayTimeUnit\":\"ns\"}\n", file);
+
+  return ferror(file) ? -1 : 0;
+}
+
+PGDEF int pg_trace_stop(void) {
+  if (!__atomic_exchange_n(&pg__trace_enabled, 0, __ATOMIC_ACQ_REL))
+    return 0;
+
+  TraceBuffer *buffers =
+      __atomic_exchange_n(&pg__trace_buffers, NULL, __ATOMIC_ACQUIRE);
+  int result = 0;
+
+  FILE *file = fopen(pg__trace_path, "w");
+  if (!file) {
+    fwprintf(stderr, L"Error open trace file %s: %s\n", pg__trace_path,
+             strerror(errno));
+    result = -1;
+  } else {
+    result = pg__trace_write(file, buffers);
+    if (fclose(file) != 0)
+      result = -1;
+    if (result != 0)
+      fwprintf(stderr, L"Error write trace file %s\n", pg__trace_path);
+  }
+
+  const pg_allocator *previous = pg__use(NULL);
+
+  while (buffers) {
+    TraceBuffer *next = buffers->next;
+    PG_FREE(buffers);
+    buffers = next;
+  }
+
+  PG_FREE(pg__trace_path);
+  pg__trace_path = NULL;
+
+  pg__use(previous);
+
+  return result;
 }
 
 PGDEF const pgu32 pg_version() { return PG_VERSION; }
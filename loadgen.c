@@ -0,0 +1,408 @@
+#include <locale.h>
+
+#define PG_CONVERTER_IMPLEMENTATION
+#include "pigaco/converter.h"
+
+#include "bench_images.h"
+
+#define LOAD_MAX_CLIENTS 256
+
+/* Log-linear latency histogram: exact below 128 ns, then 64 buckets per
+ * power of two, so any recorded value is within 1.6% of its bucket. */
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (2 * HIST_SUB + (64 - HIST_SUB_BITS - 1) * HIST_SUB)
+
+typedef struct {
+  unsigned long long counts[HIST_BUCKETS];
+  unsigned long long count;
+  unsigned long long max;
+} Histogram;
+
+enum {
+  STAGE_QUEUE,
+  STAGE_DECODE,
+  STAGE_TONE,
+  STAGE_GRAY,
+  STAGE_SAMPLE,
+  STAGE_DITHER,
+  STAGE_RENDER,
+  STAGE_SERVICE,
+  STAGE_TOTAL,
+  STAGE_COUNT
+};
+
+static const char *stage_names[STAGE_COUNT] = {
+    "queue", "decode", "tone",    "gray", "sample",
+    "dither", "render", "service", "total"};
+
+typedef struct {
+  int size;
+  int weight;
+  pgu8 *encoded;
+  int length;
+} LoadImage;
+
+typedef struct {
+  LoadImage *images;
+  int image_count;
+  int total_weight;
+  /* Intended start of every request relative to start_ns, fixed before the
+   * run so a slow response never delays the requests behind it. */
+  unsigned long long *schedule;
+  int requests;
+  unsigned long long start_ns;
+  int next;
+  pg_options opts;
+} LoadPlan;
+
+typedef struct {
+  LoadPlan *plan;
+  pthread_t thread;
+  Histogram stages[STAGE_COUNT];
+  int completed;
+  int failed;
+} LoadClient;
+
+static int hist_index(unsigned long long value) {
+  if (value < 2 * HIST_SUB)
+    return (int)value;
+
+  int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+  return shift * HIST_SUB + (int)(value >> shift);
+}
+
+/* Largest value that lands in bucket index. */
+static unsigned long long hist_value(int index) {
+  if (index < 2 * HIST_SUB)
+    return (unsigned long long)index;
+
+  int shift = index / HIST_SUB - 1;
+  unsigned long long mantissa = (unsigned long long)(index % HIST_SUB);
+  return ((mantissa + HIST_SUB + 1) << shift) - 1;
+}
+
+static void hist_record(Histogram *hist, unsigned long long value) {
+  hist->counts[hist_index(value)]++;
+  hist->count++;
+  if (value > hist->max)
+    hist->max = value;
+}
+
+static void hist_merge(Histogram *dst, const Histogram *src) {
+  for (int i = 0; i < HIST_BUCKETS; i++)
+    dst->counts[i] += src->counts[i];
+  dst->count += src->count;
+  if (src->max > dst->max)
+    dst->max = src->max;
+}
+
+static unsigned long long hist_percentile(const Histogram *hist,
+                                          double percentile) {
+  unsigned long long rank =
+      (unsigned long long)(percentile / 100.0 * hist->count + 0.999999);
+  unsigned long long seen = 0;
+
+  if (rank == 0)
+    rank = 1;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += hist->counts[i];
+    if (seen >= rank) {
+      unsigned long long value = hist_value(i);
+      return value < hist->max ? value : hist->max;
+    }
+  }
+
+  return hist->max;
+}
+
+static void sleep_until(unsigned long long deadline_ns) {
+  struct timespec ts;
+  ts.tv_sec = (time_t)(deadline_ns / 1000000000ull);
+  ts.tv_nsec = (long)(deadline_ns % 1000000000ull);
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+static const LoadImage *pick_image(const LoadPlan *plan, pgu32 *state) {
+  int ticket = (int)(bench_rand(state) % (pgu32)plan->total_weight);
+
+  for (int i = 0; i < plan->image_count; i++) {
+    if (ticket < plan->images[i].weight)
+      return &plan->images[i];
+    ticket -= plan->images[i].weight;
+  }
+
+  return &plan->images[plan->image_count - 1];
+}
+
+/* Each client claims the next request, waits for its scheduled time if it
+ * is early, and measures latency from that scheduled time, so time spent
+ * waiting for a free client counts against the request. */
+static void *load_client(void *arg) {
+  LoadClient *client = (LoadClient *)arg;
+  LoadPlan *plan = client->plan;
+  pg_converter *conv = pg_converter_create(NULL);
+
+  if (!conv)
+    return NULL;
+  pg_converter_set_stats(conv, 1);
+
+  for (;;) {
+    int request = __atomic_fetch_add(&plan->next, 1, __ATOMIC_RELAXED);
+    if (request >= plan->requests)
+      break;
+
+    unsigned long long intended = plan->start_ns + plan->schedule[request];
+    pgu32 state = (pgu32)request * 2654435761u + 1;
+    const LoadImage *image = pick_image(plan, &state);
+
+    if (pg__now_ns() < intended)
+      sleep_until(intended);
+
+    unsigned long long start = pg__now_ns();
+    int result = pg_convert_memory(conv, image->encoded, image->length,
+                                   &plan->opts);
+    unsigned long long end = pg__now_ns();
+
+    if (result != 0) {
+      client->failed++;
+      continue;
+    }
+
+    const pg_stats *stats = pg_converter_stats(conv);
+    Histogram *stages = client->stages;
+
+    hist_record(&stages[STAGE_QUEUE], start - intended);
+    hist_record(&stages[STAGE_DECODE], stats->decode_ns);
+    hist_record(&stages[STAGE_TONE], stats->tone_ns);
+    hist_record(&stages[STAGE_GRAY], stats->gray_ns);
+    hist_record(&stages[STAGE_SAMPLE], stats->sample_ns);
+    hist_record(&stages[STAGE_DITHER], stats->dither_ns);
+    hist_record(&stages[STAGE_RENDER], stats->render_ns);
+    hist_record(&stages[STAGE_SERVICE], end - start);
+    hist_record(&stages[STAGE_TOTAL], end - intended);
+    client->completed++;
+  }
+
+  pg_converter_destroy(conv);
+
+  return NULL;
+}
+
+static int build_images(LoadPlan *plan, int max_size) {
+  static const int sizes[] = {64, 256, 512, 1024, 2048, 4096};
+  static const int weights[] = {40, 30, 15, 10, 4, 1};
+  int count = 0;
+
+  plan->images = (LoadImage *)PG_MALLOC(sizeof(sizes) / sizeof(sizes[0]) *
+                                        sizeof(LoadImage));
+  if (!plan->images)
+    return -1;
+
+  plan->total_weight = 0;
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    int size = sizes[i];
+    if (size > max_size)
+      break;
+
+    pgu8 *rgb = (pgu8 *)PG_MALLOC((size_t)size * size * 3);
+    if (!rgb)
+      return -1;
+
+    /* Photo-like content so every dither and color path does real work. */
+    fill_photo(rgb, size, size);
+
+    LoadImage *image = &plan->images[count];
+    image->size = size;
+    image->weight = weights[i];
+    image->encoded = encode_ppm(rgb, size, size, &image->length);
+    PG_FREE(rgb);
+    if (!image->encoded)
+      return -1;
+
+    plan->total_weight += image->weight;
+    plan->image_count = ++count;
+  }
+
+  return count > 0 ? 0 : -1;
+}
+
+/* Fixed-rate arrivals, or exponential inter-arrival times (a Poisson
+ * process at the same mean rate) to model bursty clients. */
+static int build_schedule(LoadPlan *plan, double rate, double duration,
+                          int poisson) {
+  double interval = 1e9 / rate;
+  double at = 0;
+  pgu32 state = 0x6d2b79f5u;
+
+  plan->requests = (int)(rate * duration);
+  if (plan->requests < 1)
+    plan->requests = 1;
+
+  plan->schedule = (unsigned long long *)PG_MALLOC(
+      (size_t)plan->requests * sizeof(unsigned long long));
+  if (!plan->schedule)
+    return -1;
+
+  for (int i = 0; i < plan->requests; i++) {
+    plan->schedule[i] = (unsigned long long)at;
+    if (poisson) {
+      double u = (bench_rand(&state) + 1.0) / 4294967297.0;
+      at += -log(u) * interval;
+    } else {
+      at += interval;
+    }
+  }
+
+  return 0;
+}
+
+static void print_histograms(const Histogram *stages) {
+  wprintf(L"%-8s %9s %10s %10s %10s %10s %10s\n", "stage", "count",
+          "p50 ms", "p95 ms", "p99 ms", "p99.9 ms", "max ms");
+
+  for (int i = 0; i < STAGE_COUNT; i++) {
+    const Histogram *hist = &stages[i];
+    if (hist->count == 0)
+      continue;
+
+    wprintf(L"%-8s %9llu %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+            stage_names[i], hist->count, hist_percentile(hist, 50.0) / 1e6,
+            hist_percentile(hist, 95.0) / 1e6,
+            hist_percentile(hist, 99.0) / 1e6,
+            hist_percentile(hist, 99.9) / 1e6, hist->max / 1e6);
+  }
+}
+
+static void usage(void) {
+  fwprintf(stderr, L"%s\n",
+           "Usage: pigaco_loadgen [--rate <req/s>] [--duration <s>] "
+           "[--clients <n>] [--threads <n>] [--max-size <64..4096>] "
+           "[--color <0..3>] [--dither <0..8>] [--poisson]");
+}
+
+int main(int argc, char **argv) {
+  setlocale(LC_ALL, "en_US.UTF-8");
+
+  double rate = 50.0;
+  double duration = 10.0;
+  int clients = 8;
+  int threads = 0;
+  int max_size = 1024;
+  int poisson = 0;
+  LoadPlan plan;
+
+  memset(&plan, 0, sizeof(plan));
+  plan.opts = pg_default_options();
+  plan.opts.use_color = PG_COLOR_TRUECOLOR;
+
+  for (int arg = 1; arg < argc; arg++) {
+    if (strcmp(argv[arg], "--poisson") == 0) {
+      poisson = 1;
+      continue;
+    }
+    if (arg + 1 >= argc) {
+      usage();
+      return -1;
+    }
+    if (strcmp(argv[arg], "--rate") == 0)
+      rate = atof(argv[++arg]);
+    else if (strcmp(argv[arg], "--duration") == 0)
+      duration = atof(argv[++arg]);
+    else if (strcmp(argv[arg], "--clients") == 0)
+      clients = atoi(argv[++arg]);
+    else if (strcmp(argv[arg], "--threads") == 0)
+      threads = atoi(argv[++arg]);
+    else if (strcmp(argv[arg], "--max-size") == 0)
+      max_size = atoi(argv[++arg]);
+    else if (strcmp(argv[arg], "--color") == 0)
+      plan.opts.use_color = atoi(argv[++arg]);
+    else if (strcmp(argv[arg], "--dither") == 0)
+      plan.opts.dither = atoi(argv[++arg]);
+    else {
+      usage();
+      return -1;
+    }
+  }
+
+  if (rate <= 0 || duration <= 0 || clients < 1 ||
+      clients > LOAD_MAX_CLIENTS || threads < 0 || max_size < 64 ||
+      max_size > 4096 || plan.opts.use_color < PG_COLOR_NONE ||
+      plan.opts.use_color > PG_COLOR_16 ||
+      plan.opts.dither < PG_DITHER_NONE ||
+      plan.opts.dither > PG_DITHER_BLUE_NOISE) {
+    usage();
+    return -1;
+  }
+
+  if (pg_init(threads) != 0 || build_images(&plan, max_size) != 0 ||
+      build_schedule(&plan, rate, duration, poisson) != 0) {
+    fwprintf(stderr, L"Failed to prepare the load\n");
+    return -1;
+  }
+
+  LoadClient *workers =
+      (LoadClient *)PG_MALLOC((size_t)clients * sizeof(LoadClient));
+  if (!workers)
+    return -1;
+  memset(workers, 0, (size_t)clients * sizeof(LoadClient));
+
+  wprintf(L"%d requests at %.1f req/s (%s) over %.1f s, %d clients, "
+          L"images:",
+          plan.requests, rate, poisson ? "poisson" : "fixed", duration,
+          clients);
+  for (int i = 0; i < plan.image_count; i++)
+    wprintf(L" %dpx x%d", plan.images[i].size, plan.images[i].weight);
+  wprintf(L"\n");
+  fflush(stdout);
+
+  /* Give the clients a moment to start before the first request is due. */
+  plan.start_ns = pg__now_ns() + 10000000ull;
+
+  int started = 0;
+  for (; started < clients; started++) {
+    workers[started].plan = &plan;
+    if (pthread_create(&workers[started].thread, NULL, load_client,
+                       &workers[started]) != 0)
+      break;
+  }
+  for (int i = 0; i < started; i++)
+    pthread_join(workers[i].thread, NULL);
+
+  unsigned long long elapsed = pg__now_ns() - plan.start_ns;
+  Histogram *stages = (Histogram *)PG_MALLOC(sizeof(Histogram) * STAGE_COUNT);
+  int completed = 0, failed = 0;
+
+  if (!stages)
+    return -1;
+  memset(stages, 0, sizeof(Histogram) * STAGE_COUNT);
+
+  for (int i = 0; i < started; i++) {
+    for (int s = 0; s < STAGE_COUNT; s++)
+      hist_merge(&stages[s], &workers[i].stages[s]);
+    completed += workers[i].completed;
+    failed += workers[i].failed;
+  }
+
+  double achieved = completed / (elapsed / 1e9);
+  wprintf(L"completed %d, failed %d, achieved %.1f req/s\n", completed,
+          failed, achieved);
+  if (achieved < rate * 0.95)
+    wprintf(L"warning: achieved rate is below the target, the library is "
+            L"saturated and queue time dominates the tail\n");
+
+  print_histograms(stages);
+
+  PG_FREE(stages);
+  PG_FREE(workers);
+  for (int i = 0; i < plan.image_count; i++)
+    PG_FREE(plan.images[i].encoded);
+  PG_FREE(plan.images);
+  PG_FREE(plan.schedule);
+
+  pg_shutdown();
+
+  return failed == 0 ? 0 : 1;
+}
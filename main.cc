@@ -3,17 +3,76 @@
 #define PG_CONVERTER_IMPLEMENTATION
 #include "pigaco/converter.h"
 
+static int convert_with_stats(const char *filename, int counters) {
+  pg_counting counting;
+  memset(&counting, 0, sizeof(counting));
+
+  pg_allocator allocator = pg::pg_counting_allocator(&counting);
+  pg_converter *conv = pg::pg_converter_create_with_allocator(NULL, &allocator);
+  if (!conv)
+    return -1;
+
+  pg::pg_converter_set_stats(conv, 1);
+  if (counters)
+    pg::pg_converter_set_counters(conv, 1);
+
+  pg_options opts = pg::pg_default_options();
+  int result = pg::pg_convert_file(conv, filename, &opts);
+
+  if (result == 0)
+    result = pg::pg_converter_write(conv, STDOUT_FILENO);
+  if (result == 0) {
+    pg::pg_stats_print(pg::pg_converter_stats(conv));
+    fwprintf(stderr, L"peak %zu bytes live over %zu allocations\n",
+             counting.peak, counting.count);
+  }
+
+  pg::pg_converter_destroy(conv);
+
+  return result;
+}
+
 int main(int argc, char **argv) {
   setlocale(LC_ALL, "en_US.UTF-8");
 
-  if (argc < 2) {
-    fwprintf(stderr, L"%s\n", "You need to enter the name of <image file>");
+  int stats = 0;
+  int counters = 0;
+  const char *trace = NULL;
+  const char *filename = NULL;
+  int usage = 0;
+
+  for (int arg = 1; arg < argc; arg++) {
+    if (strcmp(argv[arg], "--stats") == 0)
+      stats = 1;
+    else if (strcmp(argv[arg], "--counters") == 0)
+      stats = counters = 1;
+    else if (strcmp(argv[arg], "--trace") == 0 && arg + 1 < argc)
+      trace = argv[++arg];
+    else if (argv[arg][0] != '-' && !filename)
+      filename = argv[arg];
+    else
+      usage = 1;
+  }
+
+  if (usage || !filename) {
+    fwprintf(stderr, L"%s\n",
+             "You need to enter the name of <image file> "
+             "[--stats] [--counters] [--trace <trace.json>]");
     return -1;
   }
 
   wprintf(L"Version of the converter %d\n", pg::pg_version());
+  fflush(stdout);
+
+  if (trace)
+    pg::pg_trace_start(trace);
+
+  if (stats)
+    convert_with_stats(filename, counters);
+  else
+    pg::convert_image_to_ascii(filename, 8, 0.5f);
 
-  pg::convert_image_to_ascii(argv[1], 8, 0.5f);
+  pg::pg_shutdown();
 
   return 0;
 }
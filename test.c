@@ -0,0 +1,405 @@
+#include <locale.h>
+
+#define PG_CONVERTER_IMPLEMENTATION
+#include "pigaco/converter.h"
+
+#include "bench_images.h"
+
+#define TEST_MIN_THREADS 4
+
+#define TEST_GRAY_MAX 4099
+
+typedef struct {
+  const char *name;
+  pg_gray_kernel kernel;
+  int supported;
+} GrayKernel;
+
+/* Every SIMD luma kernel the CPU runs must match the scalar one exactly,
+ * including the scalar tail after the last full vector, and must not write
+ * past count. */
+static int test_gray_kernels(void) {
+  static const int counts[] = {0,   1,   2,   3,   15,   16,  17,
+                               31,  32,  33,  47,  48,   49,  63,
+                               64,  65,  95,  96,  97,   127, 128,
+                               129, 191, 192, 193, 1000, TEST_GRAY_MAX};
+  GrayKernel kernels[3];
+  int kernel_count = 0;
+  static pgu8 rgb[TEST_GRAY_MAX * 3];
+  static pgu8 expected[TEST_GRAY_MAX + 64];
+  static pgu8 gray[TEST_GRAY_MAX + 64];
+  int failures = 0;
+
+#ifdef PG_X86_SIMD
+  __builtin_cpu_init();
+  kernels[kernel_count++] = (GrayKernel){"ssse3", pg__gray_rgb_ssse3,
+                                         __builtin_cpu_supports("ssse3")};
+  kernels[kernel_count++] = (GrayKernel){"avx2", pg__gray_rgb_avx2,
+                                         __builtin_cpu_supports("avx2")};
+  kernels[kernel_count++] = (GrayKernel){
+      "avx512", pg__gray_rgb_avx512,
+      __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")};
+#endif
+
+  for (int fill = 0; fill < 3; fill++) {
+    pgu32 state = 0x1b873593u;
+
+    for (int i = 0; i < TEST_GRAY_MAX * 3; i++)
+      rgb[i] = fill == 0   ? 0
+               : fill == 1 ? 255
+                           : (pgu8)(bench_rand(&state) >> 24);
+
+    for (int k = 0; k < kernel_count; k++) {
+      if (!kernels[k].supported)
+        continue;
+
+      for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        int count = counts[i];
+
+        memset(expected, 0xa5, sizeof(expected));
+        memset(gray, 0xa5, sizeof(gray));
+        pg__gray_rgb_scalar(rgb, expected, count);
+        kernels[k].kernel(rgb, gray, count);
+
+        if (memcmp(gray, expected, sizeof(gray)) != 0) {
+          fwprintf(stderr, L"gray %s: %d pixels of %s differ from scalar\n",
+                   kernels[k].name, count,
+                   fill == 0 ? "0" : fill == 1 ? "255" : "noise");
+          failures++;
+        }
+      }
+    }
+  }
+
+  return failures;
+}
+
+#define TEST_ORDERED_WIDTH 259
+
+/* The SSE2 ordered dither must match the scalar one on every map, for every
+ * row of the threshold period, every alignment of the row start and every
+ * gray value, including the scalar tail. */
+static int test_ordered_kernels(void) {
+  static pgu8 source[32 + TEST_ORDERED_WIDTH + 64];
+  static pgu8 expected[32 + TEST_ORDERED_WIDTH + 64];
+  static pgu8 row[32 + TEST_ORDERED_WIDTH + 64];
+  int simd = pg__ordered_simd;
+  int failures = 0;
+
+  if (!simd)
+    return 0;
+
+  for (size_t i = 0; i < sizeof(source); i++)
+    source[i] = (pgu8)(i * 167 + 13);
+
+  for (int dither = PG_DITHER_BAYER4; dither <= PG_DITHER_BLUE_NOISE;
+       dither++) {
+    OrderedMap map;
+    pg__ordered_map(dither, &map);
+
+    for (int y = 0; y < 32; y++) {
+      for (int offset = 0; offset < 32; offset++) {
+        memcpy(expected, source, sizeof(source));
+        memcpy(row, source, sizeof(source));
+
+        pg__ordered_simd = 0;
+        pg__ordered_row(expected + offset, TEST_ORDERED_WIDTH, y, &map);
+        pg__ordered_simd = simd;
+        pg__ordered_row(row + offset, TEST_ORDERED_WIDTH, y, &map);
+
+        if (memcmp(row, expected, sizeof(row)) != 0) {
+          fwprintf(stderr, L"ordered %d: row %d at offset %d differs\n",
+                   dither, y, offset);
+          failures++;
+        }
+      }
+    }
+  }
+
+  return failures;
+}
+
+/* Bottom-left diffusion, worked by hand. The 121 at (1, 1) quantizes to 115
+ * and passes 6 * 3 / 16 down-left, lifting the 121 at (0, 2) to 122, which
+ * rounds up to 127. The old index, y + 1 * width + (x - 1), stored that sum
+ * over (1, 1) instead, leaving 122 there and 115 at (0, 2). */
+static int test_dither_bottom_left(void) {
+  pgu8 gray[6] = {115, 115, 115, 121, 121, 115};
+  static const pgu8 expected[6] = {115, 115, 115, 115, 127, 115};
+
+  floyd__steinberg_dither(gray, 2, 3);
+
+  if (memcmp(gray, expected, sizeof(expected)) != 0) {
+    fwprintf(stderr, L"dither bottom-left: got %d %d %d %d %d %d\n", gray[0],
+             gray[1], gray[2], gray[3], gray[4], gray[5]);
+    return 1;
+  }
+
+  return 0;
+}
+
+/* The wavefront must match the serial scan byte for byte at every size and
+ * thread count, down to single rows and columns. */
+static int test_dither_wavefront(int max_threads) {
+  static const int sizes[][2] = {{1, 1},   {1, 64},   {64, 1},  {2, 2},
+                                 {3, 7},   {7, 3},    {17, 33}, {33, 17},
+                                 {255, 3}, {3, 255},  {63, 65}, {127, 129},
+                                 {320, 241}, {1001, 77}};
+  int failures = 0;
+
+  for (int t = 1; t <= max_threads; t++) {
+    pg_pool *pool = pg_pool_create(t);
+    if (!pool)
+      return 1;
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+      int width = sizes[i][0], height = sizes[i][1];
+      size_t pixels = (size_t)width * height;
+      pgu8 *rgb = (pgu8 *)PG_MALLOC(pixels * 3);
+      pgu8 *serial = (pgu8 *)PG_MALLOC(pixels);
+      pgu8 *wavefront = (pgu8 *)PG_MALLOC(pixels);
+
+      if (!rgb || !serial || !wavefront) {
+        PG_FREE(rgb);
+        PG_FREE(serial);
+        PG_FREE(wavefront);
+        pg_pool_destroy(pool);
+        return failures + 1;
+      }
+
+      fill_photo(rgb, width, height);
+      pg__gray_rgb_scalar(rgb, serial, (int)pixels);
+      memcpy(wavefront, serial, pixels);
+
+      floyd__steinberg_dither(serial, width, height);
+      floyd__steinberg_dither_wavefront(pool, wavefront, width, height);
+
+      if (memcmp(serial, wavefront, pixels) != 0) {
+        fwprintf(stderr, L"dither wavefront: %dx%d differs on %d threads\n",
+                 width, height, t);
+        failures++;
+      }
+
+      PG_FREE(rgb);
+      PG_FREE(serial);
+      PG_FREE(wavefront);
+    }
+
+    pg_pool_destroy(pool);
+  }
+
+  return failures;
+}
+
+#define TEST_CLIENTS 4
+#define TEST_ROUNDS 8
+#define TEST_SIZE 317
+
+typedef struct {
+  pg_pool *pool;
+  const pgu8 *rgb;
+  const pg_frame *expected;
+  pg_options opts;
+  pthread_t thread;
+  int failures;
+} ConvertClient;
+
+static void *convert_client(void *arg) {
+  ConvertClient *client = (ConvertClient *)arg;
+  pg_converter *conv = pg_converter_create(client->pool);
+
+  if (!conv) {
+    client->failures++;
+    return NULL;
+  }
+
+  for (int round = 0; round < TEST_ROUNDS; round++) {
+    const pg_frame *frame = pg_converter_frame(conv);
+
+    if (pg_convert_pixels(conv, client->rgb, TEST_SIZE, TEST_SIZE, 3, 0,
+                          &client->opts) != 0 ||
+        frame->size != client->expected->size ||
+        memcmp(frame->data, client->expected->data, frame->size) != 0)
+      client->failures++;
+  }
+
+  pg_converter_destroy(conv);
+
+  return NULL;
+}
+
+/* Conversions sharing a pool get disjoint workers, however many each
+ * asks for, and must still match a single-threaded conversion. */
+static int test_concurrent_conversions(int max_threads) {
+  pg_pool *pool = pg_pool_create(max_threads);
+  pgu8 *rgb = (pgu8 *)PG_MALLOC((size_t)TEST_SIZE * TEST_SIZE * 3);
+  pg_converter *serial = pg_converter_create(pool);
+  ConvertClient clients[TEST_CLIENTS];
+  int failures = 0;
+
+  if (!pool || !rgb || !serial) {
+    pg_converter_destroy(serial);
+    PG_FREE(rgb);
+    pg_pool_destroy(pool);
+    return 1;
+  }
+
+  fill_photo(rgb, TEST_SIZE, TEST_SIZE);
+
+  pg_options opts = pg_default_options();
+  opts.sampling = PG_SAMPLE_BOX;
+  opts.dither = PG_DITHER_FLOYD_STEINBERG;
+  opts.threads = 1;
+
+  if (pg_convert_pixels(serial, rgb, TEST_SIZE, TEST_SIZE, 3, 0, &opts) != 0)
+    failures++;
+
+  opts.threads = max_threads;
+  for (int i = 0; i < TEST_CLIENTS; i++) {
+    clients[i].pool = pool;
+    clients[i].rgb = rgb;
+    clients[i].expected = pg_converter_frame(serial);
+    clients[i].opts = opts;
+    clients[i].failures = 0;
+    if (pthread_create(&clients[i].thread, NULL, convert_client,
+                       &clients[i]) != 0)
+      clients[i].failures = -1;
+  }
+
+  for (int i = 0; i < TEST_CLIENTS; i++) {
+    if (clients[i].failures < 0) {
+      failures++;
+      continue;
+    }
+    pthread_join(clients[i].thread, NULL);
+    if (clients[i].failures) {
+      fwprintf(stderr, L"concurrent conversions: client %d differs %d times\n",
+               i, clients[i].failures);
+      failures++;
+    }
+  }
+
+  pg_converter_destroy(serial);
+  PG_FREE(rgb);
+  pg_pool_destroy(pool);
+
+  return failures;
+}
+
+/* After warm-up, converting same-sized images allocates nothing: decoding
+ * reuses the converter's scratch arena and every other buffer only grows. */
+static int test_steady_state_allocations(int max_threads) {
+  pg_counting counting;
+  memset(&counting, 0, sizeof(counting));
+
+  pg_allocator allocator = pg_counting_allocator(&counting);
+  pg_pool *pool = pg_pool_create(max_threads);
+  pg_converter *conv = pg_converter_create_with_allocator(pool, &allocator);
+  pgu8 *rgb = (pgu8 *)PG_MALLOC((size_t)TEST_SIZE * TEST_SIZE * 3);
+  pgu8 *encoded = NULL;
+  int length = 0;
+  int failures = 0;
+
+  if (rgb) {
+    fill_photo(rgb, TEST_SIZE, TEST_SIZE);
+    encoded = encode_ppm(rgb, TEST_SIZE, TEST_SIZE, &length);
+  }
+  if (!pool || !conv || !encoded) {
+    failures++;
+    goto done;
+  }
+
+  pg_options opts = pg_default_options();
+
+  for (int round = 0; round < 2 + TEST_ROUNDS; round++) {
+    if (round == 2)
+      pg_counting_reset(&counting);
+    if (pg_convert_memory(conv, encoded, length, &opts) != 0) {
+      failures++;
+      goto done;
+    }
+  }
+
+  if (counting.count != 0) {
+    fwprintf(stderr, L"steady state: %zu allocations after warm-up\n",
+             counting.count);
+    failures++;
+  }
+
+done:
+  pg_converter_destroy(conv);
+  pg_pool_destroy(pool);
+  PG_FREE(encoded);
+  PG_FREE(rgb);
+
+  return failures;
+}
+
+/* A reset sizes each thread's block to the cycle it ends: a large cycle
+ * spread over several blocks is merged into one, and a small cycle after
+ * it gives that block back. */
+static int test_arena_reset(void) {
+  pg_arena *arena = pg_arena_create(0);
+  int failures = 0;
+
+  if (!arena)
+    return 1;
+
+  pg_allocator allocator = pg_arena_allocator(arena);
+  size_t initial = 0;
+
+  allocator.allocate(allocator.user, 1000);
+  pg_arena_reset(arena);
+  initial = pg_arena_reserved(arena);
+
+  for (int i = 0; i < 64; i++)
+    allocator.allocate(allocator.user, 1 << 20);
+  size_t large = pg_arena_reserved(arena);
+  pg_arena_reset(arena);
+  size_t merged = pg_arena_reserved(arena);
+
+  for (int i = 0; i < 64; i++)
+    allocator.allocate(allocator.user, 1 << 20);
+  size_t again = pg_arena_reserved(arena);
+  pg_arena_reset(arena);
+
+  allocator.allocate(allocator.user, 1000);
+  pg_arena_reset(arena);
+  size_t small = pg_arena_reserved(arena);
+
+  if (merged < (size_t)64 << 20 || merged >= large || again != merged ||
+      small != initial) {
+    fwprintf(stderr,
+             L"arena reset: reserved %zu, large %zu, merged %zu, again %zu, "
+             L"small %zu\n",
+             initial, large, merged, again, small);
+    failures++;
+  }
+
+  pg_arena_destroy(arena);
+
+  return failures;
+}
+
+int main(void) {
+  setlocale(LC_ALL, "en_US.UTF-8");
+
+  int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (max_threads < TEST_MIN_THREADS)
+    max_threads = TEST_MIN_THREADS;
+
+  pthread_once(&pg__tables_once, pg__init_tables);
+
+  int failures = test_gray_kernels();
+  failures += test_ordered_kernels();
+  failures += test_dither_bottom_left();
+  failures += test_dither_wavefront(max_threads);
+  failures += test_concurrent_conversions(max_threads);
+  failures += test_steady_state_allocations(max_threads);
+  failures += test_arena_reset();
+
+  if (failures)
+    fwprintf(stderr, L"%d failed\n", failures);
+
+  return failures ? 1 : 0;
+}